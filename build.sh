@@ -10,6 +10,7 @@ g++ ./src/unity.cpp \
     -O0 \
     -g \
     -Wall -Wpedantic \
+    -pthread \
     -o "$BUILD_DIR/main"
 
 echo "Running"
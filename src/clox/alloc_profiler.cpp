@@ -0,0 +1,189 @@
+#include "alloc_profiler.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace AllocProfilerImpl
+{
+	using namespace Lox;
+
+	// Everything in here uses std:: containers and not Lox:: ones, as the profiler shouldn't count against the heap it's
+	// watching, or take samples of itself
+	struct StackSamples
+	{
+		std::string stack;
+		f64 allocated_bytes = 0.0;
+	};
+
+	struct LiveSample
+	{
+		std::size_t stack_index = 0;
+		f64 bytes = 0.0;
+	};
+
+	std::size_t mean_sample_bytes = 0;
+	std::minstd_rand random_engine;
+
+	// Every sample of the same stack adds up in one place
+	std::vector<StackSamples> stacks;
+	std::unordered_map<std::string, std::size_t> stack_indices;
+
+	// Sampled objects that are still alive. Parallel sweeping destroys objects on several threads at once
+	std::unordered_map<const Object*, LiveSample> live_samples;
+	std::mutex live_samples_mutex;
+
+	std::ptrdiff_t next_sample_distance()
+	{
+		std::exponential_distribution<f64> distribution{1.0 / (f64)mean_sample_bytes};
+		return (std::ptrdiff_t)distribution(random_engine) + 1;
+	}
+
+	// Bigger allocations are more likely to be the one that crosses the sample point, so this scales each sample by
+	// how much allocation of its size it stands for, the same way tcmalloc does
+	f64 sample_weight(std::size_t bytes)
+	{
+		f64 size = (f64)bytes;
+		return size / (1.0 - std::exp(-size / (f64)mean_sample_bytes));
+	}
+
+	// The Lox call stack from the script down to the allocating line, with what was allocated as the leaf
+	std::string current_stack(const char* kind)
+	{
+		std::string stack;
+		if (vm.frames_position == 0)
+		{
+			stack = "[host]";	 // Compiling, or setting up the VM
+		}
+
+		for (i32 frame_index = 0; frame_index < vm.frames_position; ++frame_index)
+		{
+			const CallFrame& frame = vm.frames[frame_index];
+			const ObjectFunction* function = frame.closure->function;
+
+			// The ip already points past the instruction that is running, or that made the call
+			i32 offset = std::max((i32)(frame.ip - function->chunk.code.data()) - 1, 0);
+
+			if (!stack.empty())
+			{
+				stack += ';';
+			}
+			stack += function->name != nullptr ? std::string_view{function->name->get_string()} : "script";
+			stack += ':';
+			stack += std::to_string(function->chunk.get_line(offset));
+		}
+
+		stack += ";[";
+		stack += kind;
+		stack += ']';
+		return stack;
+	}
+
+	void write_folded(const std::string& path, const std::vector<f64>& bytes_by_stack)
+	{
+		std::ofstream stream{path, std::ios::trunc};
+		for (std::size_t index = 0; index < stacks.size(); ++index)
+		{
+			if (bytes_by_stack[index] >= 1.0)
+			{
+				stream << stacks[index].stack << ' ' << (u64)bytes_by_stack[index] << '\n';
+			}
+		}
+
+		if (!stream.good())
+		{
+			std::cerr << "Could not write allocation profile '" << path << "'" << std::endl;
+		}
+	}
+}	 // namespace AllocProfilerImpl
+
+void Lox::start_allocation_profiler(std::size_t sample_bytes)
+{
+	using namespace AllocProfilerImpl;
+
+	mean_sample_bytes = std::max(sample_bytes, (std::size_t)1);
+	bytes_until_allocation_sample = next_sample_distance();
+}
+
+void Lox::take_allocation_sample(Object* object, std::size_t bytes, const char* kind)
+{
+	using namespace AllocProfilerImpl;
+
+	// With the profiler off, we only get here after allocating PTRDIFF_MAX bytes, and just push the next sample out of reach again
+	if (mean_sample_bytes == 0)
+	{
+		bytes_until_allocation_sample = PTRDIFF_MAX;
+		return;
+	}
+
+	bytes_until_allocation_sample = next_sample_distance();
+
+	auto [iter, inserted] = stack_indices.try_emplace(current_stack(kind), stacks.size());
+	if (inserted)
+	{
+		stacks.push_back(StackSamples{iter->first});
+	}
+
+	f64 weight = sample_weight(bytes);
+	stacks[iter->second].allocated_bytes += weight;
+
+	if (object != nullptr)
+	{
+		std::lock_guard lock{live_samples_mutex};
+		object->is_sampled = true;
+		live_samples[object] = LiveSample{iter->second, weight};
+	}
+}
+
+void Lox::move_allocation_sample(const Object* from, Object* to)
+{
+	using namespace AllocProfilerImpl;
+
+	std::lock_guard lock{live_samples_mutex};
+	auto iter = live_samples.find(from);
+	if (iter != live_samples.end())
+	{
+		LiveSample sample = iter->second;
+		live_samples.erase(iter);
+		live_samples[to] = sample;
+	}
+}
+
+void Lox::forget_allocation_sample(const Object* object)
+{
+	using namespace AllocProfilerImpl;
+
+	std::lock_guard lock{live_samples_mutex};
+	live_samples.erase(object);
+}
+
+void Lox::write_allocation_profile(const char* path_prefix)
+{
+	using namespace AllocProfilerImpl;
+
+	// Garbage that just wasn't collected yet would otherwise show up as retained
+	collect_all_garbage();
+
+	std::vector<f64> allocated(stacks.size());
+	std::vector<f64> retained(stacks.size());
+	for (std::size_t index = 0; index < stacks.size(); ++index)
+	{
+		allocated[index] = stacks[index].allocated_bytes;
+	}
+	for (const auto& [object, sample] : live_samples)
+	{
+		retained[sample.stack_index] += sample.bytes;
+	}
+
+	write_folded(std::string{path_prefix} + ".alloc.folded", allocated);
+	write_folded(std::string{path_prefix} + ".retained.folded", retained);
+}
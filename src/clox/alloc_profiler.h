@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Lox
+{
+	class Object;
+
+	// Sampling allocation profiler: Roughly every sample_bytes of allocation, it records the Lox call stack of whatever
+	// allocates at that moment, as function names and source lines. Sampled objects are followed until they die, so that
+	// we can tell both which code allocates the most and which code allocated what is still alive. The gaps between samples
+	// are random, which keeps allocations from being missed just because they happen at a regular interval.
+	//
+	// Allocation only counts down the bytes until the next sample, so this is cheap enough to leave on all the time
+	void start_allocation_profiler(std::size_t sample_bytes);
+
+	// Writes the samples as folded stacks, one "frame;frame;frame bytes" line per stack, which flamegraph.pl and speedscope
+	// read as they are. Allocated bytes go into <path_prefix>.alloc.folded, and the bytes of everything that is still alive
+	// after a full collection into <path_prefix>.retained.folded. Both are estimates, scaled up from the samples
+	void write_allocation_profile(const char* path_prefix);
+
+	// Keep the sampled objects up to date as they move and die
+	void move_allocation_sample(const Object* from, Object* to);
+	void forget_allocation_sample(const Object* object);
+}	 // namespace Lox
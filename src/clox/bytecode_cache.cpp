@@ -0,0 +1,399 @@
+#include "bytecode_cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "mapped_file.h"
+#include "memory.h"
+#include "object.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace BytecodeCacheImpl
+{
+	using namespace Lox;
+
+	// Reads as "LOXC" in a hex editor. Since we write everything in native byte order, this also
+	// makes us reject cache files that were written on a machine with different endianness
+	constexpr u32 CACHE_MAGIC = 0x43584F4C;
+	constexpr u32 NO_NAME = UINT32_MAX;
+
+	// Functions nested deeper than this make loading fail, so that a damaged file can't recurse as deep as it likes.
+	// That only costs a compile for scripts that really nest this deep
+	constexpr i32 FUNCTION_NESTING_MAX = 256;
+
+	enum class ConstantTag : u8
+	{
+		NIL,
+		BOOL,
+		NUMBER,
+		STRING,
+		FUNCTION
+	};
+
+	struct Header
+	{
+		u32 magic = CACHE_MAGIC;
+		u32 version = BYTECODE_VERSION;
+		u64 source_hash = 0;
+		u64 source_length = 0;
+		u32 string_count = 0;
+		u32 padding = 0;
+	};
+
+	// The string table of the cache file we're loading, which functions refer to by index. Nothing collects garbage
+	// while we're loading, so this doesn't need to keep them alive
+	std::vector<ObjectString*> loaded_strings;
+
+	// FNV-1a, which is plenty to tell apart different versions of the same script
+	u64 hash_source(const char* source, std::size_t length)
+	{
+		u64 hash = 14695981039346656037ull;
+		for (std::size_t index = 0; index < length; ++index)
+		{
+			hash ^= (u8)source[index];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	fs::path get_cache_path(const char* source_path)
+	{
+		fs::path cache_path{source_path};
+		cache_path += "c";
+		return cache_path;
+	}
+
+	struct Writer
+	{
+		std::vector<u8> bytes;
+
+		// Interned strings are written only once into a table at the start of the file, and referenced by index everywhere else
+		std::unordered_map<const ObjectString*, u32> string_indices;
+		std::vector<const ObjectString*> strings;
+
+		void write_bytes(const void* data, std::size_t length)
+		{
+			const u8* data_bytes = static_cast<const u8*>(data);
+			bytes.insert(bytes.end(), data_bytes, data_bytes + length);
+		}
+
+		template<typename T>
+		void write(const T& value)
+		{
+			write_bytes(&value, sizeof(T));
+		}
+
+		u32 string_index(const ObjectString* string)
+		{
+			auto iter = string_indices.find(string);
+			if (iter != string_indices.end())
+			{
+				return iter->second;
+			}
+
+			u32 index = (u32)strings.size();
+			strings.push_back(string);
+			string_indices[string] = index;
+			return index;
+		}
+	};
+
+	struct Reader
+	{
+		const u8* current = nullptr;
+		const u8* end = nullptr;
+		bool failed = false;
+
+		const u8* read_bytes(std::size_t length)
+		{
+			if (failed || (std::size_t)(end - current) < length)
+			{
+				failed = true;
+				return nullptr;
+			}
+
+			const u8* result = current;
+			current += length;
+			return result;
+		}
+
+		template<typename T>
+		T read()
+		{
+			T value{};
+			if (const u8* data = read_bytes(sizeof(T)))
+			{
+				std::memcpy(&value, data, sizeof(T));
+			}
+			return value;
+		}
+	};
+
+	bool write_function(Writer& writer, const ObjectFunction* function)
+	{
+		writer.write<i32>(function->arity);
+		writer.write<i32>(function->upvalue_count);
+		writer.write<i32>(function->max_slots);
+		writer.write<u32>(function->name != nullptr ? writer.string_index(function->name) : NO_NAME);
+
+		const Chunk& chunk = function->chunk;
+
+		writer.write<u32>((u32)chunk.code.size());
+		writer.write_bytes(chunk.code.data(), chunk.code.size());
+
+		writer.write<u32>((u32)chunk.lines.size());
+		writer.write_bytes(chunk.lines.data(), chunk.lines.size() * sizeof(LineStart));
+
+		writer.write<u32>((u32)chunk.constants.size());
+		for (const Value& constant : chunk.constants)
+		{
+			if (is_nil(constant))
+			{
+				writer.write(ConstantTag::NIL);
+			}
+			else if (is_bool(constant))
+			{
+				writer.write(ConstantTag::BOOL);
+				writer.write<u8>(as_bool(constant) ? 1 : 0);
+			}
+			else if (is_number(constant))
+			{
+				writer.write(ConstantTag::NUMBER);
+				writer.write<f64>(as_number(constant));
+			}
+			else if (is_string(constant))
+			{
+				writer.write(ConstantTag::STRING);
+				writer.write<u32>(writer.string_index(as_string(constant)));
+			}
+			else if (is_function(constant))
+			{
+				writer.write(ConstantTag::FUNCTION);
+				if (!write_function(writer, as_function(constant)))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				// The compiler never emits other kinds of constants, so we wouldn't know how to load this back
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	ObjectString* read_string_index(Reader& reader)
+	{
+		u32 index = reader.read<u32>();
+		if (index >= loaded_strings.size())
+		{
+			reader.failed = true;
+			return nullptr;
+		}
+
+		return loaded_strings[index];
+	}
+
+	ObjectFunction* read_function(Reader& reader, i32 nesting)
+	{
+		if (nesting > FUNCTION_NESTING_MAX)
+		{
+			reader.failed = true;
+			return nullptr;
+		}
+
+		ObjectFunction* function = ObjectFunction::allocate();
+
+		function->arity = reader.read<i32>();
+		function->upvalue_count = reader.read<i32>();
+		function->max_slots = reader.read<i32>();
+
+		u32 name_index = reader.read<u32>();
+		if (name_index != NO_NAME)
+		{
+			if (name_index >= loaded_strings.size())
+			{
+				reader.failed = true;
+				return nullptr;
+			}
+			function->name = loaded_strings[name_index];
+		}
+
+		Chunk& chunk = function->chunk;
+
+		u32 code_size = reader.read<u32>();
+		if (const u8* code = reader.read_bytes(code_size))
+		{
+			chunk.code.assign(code, code + code_size);
+		}
+
+		// The mapped bytes may not be aligned for LineStart, so copy these out instead of reading them in place
+		u32 line_count = reader.read<u32>();
+		const u8* lines = reader.read_bytes(line_count * sizeof(LineStart));
+		if (lines != nullptr && line_count > 0)
+		{
+			chunk.lines.resize(line_count);
+			std::memcpy(chunk.lines.data(), lines, line_count * sizeof(LineStart));
+		}
+
+		u32 constant_count = reader.read<u32>();
+		for (u32 index = 0; index < constant_count && !reader.failed; ++index)
+		{
+			switch (reader.read<ConstantTag>())
+			{
+				case ConstantTag::NIL:
+				{
+					chunk.add_constant(nullptr);
+					break;
+				}
+				case ConstantTag::BOOL:
+				{
+					chunk.add_constant(reader.read<u8>() != 0);
+					break;
+				}
+				case ConstantTag::NUMBER:
+				{
+					chunk.add_constant(reader.read<f64>());
+					break;
+				}
+				case ConstantTag::STRING:
+				{
+					if (ObjectString* string = read_string_index(reader))
+					{
+						chunk.add_constant(string);
+					}
+					break;
+				}
+				case ConstantTag::FUNCTION:
+				{
+					if (ObjectFunction* nested = read_function(reader, nesting + 1))
+					{
+						chunk.add_constant(nested);
+					}
+					break;
+				}
+				default:
+				{
+					reader.failed = true;
+					break;
+				}
+			}
+		}
+
+		// The source hash only tells us the file is for this script, not that it's intact. Bytecode that the compiler
+		// couldn't have produced would have the VM read out of bounds, so check it the same way the compiler counts slots
+		if (!reader.failed && (function->arity < 0 || function->upvalue_count < 0 || count_max_slots(function) != function->max_slots))
+		{
+			reader.failed = true;
+		}
+
+		return reader.failed ? nullptr : function;
+	}
+}	 // namespace BytecodeCacheImpl
+
+Lox::ObjectFunction* Lox::load_bytecode_cache(const char* source_path, const char* source, std::size_t source_length)
+{
+	using namespace BytecodeCacheImpl;
+
+	MappedFile cache_file;
+	if (!cache_file.open(get_cache_path(source_path).string().c_str()))
+	{
+		return nullptr;
+	}
+
+	Reader reader;
+	reader.current = cache_file.data();
+	reader.end = cache_file.data() + cache_file.size();
+
+	Header header = reader.read<Header>();
+	if (reader.failed						   //
+		|| header.magic != CACHE_MAGIC		   //
+		|| header.version != BYTECODE_VERSION	 //
+		|| header.source_length != source_length	//
+		|| header.source_hash != hash_source(source, source_length))
+	{
+		return nullptr;
+	}
+
+	for (u32 index = 0; index < header.string_count && !reader.failed; ++index)
+	{
+		u32 length = reader.read<u32>();
+		if (const u8* characters = reader.read_bytes(length))
+		{
+			loaded_strings.push_back(ObjectString::allocate(Lox::String{reinterpret_cast<const char*>(characters), length}));
+		}
+	}
+
+	// The VM gives the script a closure without any upvalues
+	ObjectFunction* script = reader.failed ? nullptr : read_function(reader, 0);
+	if (reader.current != reader.end || (script != nullptr && (script->arity != 0 || script->upvalue_count != 0)))
+	{
+		script = nullptr;
+	}
+
+	// From here on the caller is responsible for keeping the script function alive, just like with Lox::compile
+	loaded_strings.clear();
+
+	return script;
+}
+
+void Lox::save_bytecode_cache(const char* source_path, const char* source, std::size_t source_length, const ObjectFunction* function)
+{
+	using namespace BytecodeCacheImpl;
+
+	Writer body;
+	if (!write_function(body, function))
+	{
+		return;
+	}
+
+	Header header;
+	header.source_hash = hash_source(source, source_length);
+	header.source_length = source_length;
+	header.string_count = (u32)body.strings.size();
+
+	Writer file;
+	file.write(header);
+	for (const ObjectString* string : body.strings)
+	{
+		const Lox::String& characters = string->get_string();
+		file.write<u32>((u32)characters.size());
+		file.write_bytes(characters.data(), characters.size());
+	}
+	file.write_bytes(body.bytes.data(), body.bytes.size());
+
+	// Write to a temporary file first and then move it into place, so that a concurrent run never
+	// maps a half-written cache file. Failing to write the cache is never an error, we'll just compile again next time
+	fs::path cache_path = get_cache_path(source_path);
+	fs::path temp_path = get_temporary_path(cache_path);
+
+	std::error_code error;
+	{
+		std::ofstream stream{temp_path, std::ios::binary | std::ios::trunc};
+		if (!stream.is_open())
+		{
+			return;
+		}
+
+		stream.write(reinterpret_cast<const char*>(file.bytes.data()), (std::streamsize)file.bytes.size());
+		if (!stream.good())
+		{
+			stream.close();
+			fs::remove(temp_path, error);
+			return;
+		}
+	}
+
+	fs::rename(temp_path, cache_path, error);
+	if (error)
+	{
+		fs::remove(temp_path, error);
+	}
+}
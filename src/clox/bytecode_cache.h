@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Lox
+{
+	class ObjectFunction;
+
+	// Compiled scripts can be stored in a cache file next to their source, so that later runs can skip
+	// scanning and compiling entirely. Cache files are keyed by a hash of the source and BYTECODE_VERSION,
+	// and loading returns nullptr whenever the cache is missing or stale, so that we can just compile instead
+	ObjectFunction* load_bytecode_cache(const char* source_path, const char* source, std::size_t source_length);
+	void save_bytecode_cache(const char* source_path, const char* source, std::size_t source_length, const ObjectFunction* function);
+}	 // namespace Lox
@@ -2,6 +2,7 @@
 #include "object.h"
 #include "vm.h"
 
+#include <algorithm>
 #include <cassert>
 #include <format>
 #include <iomanip>
@@ -22,15 +23,25 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 {
 	std::cout << std::setw(4) << std::setfill('0') << offset << " ";
 
-	Lox::Op instruction = static_cast<Lox::Op>(code[offset]);
-
-	Lox::String line_number_str{(offset > 0 && lines[offset] == lines[offset - 1]) ? "    " : std::to_string(lines[offset])};
+	const u32 line = get_line(offset);
+	Lox::String line_number_str{(offset > 0 && line == get_line(offset - 1)) ? "    " : std::to_string(line)};
 	std::cout << std::setw(4) << line_number_str << " ";
+
+	// Print the prefix and then the instruction it applies to as if it started one byte later
+	bool wide = false;
+	if (static_cast<Lox::Op>(code[offset]) == Lox::Op::WIDE)
+	{
+		std::cout << "WIDE ";
+		wide = true;
+		offset++;
+	}
+
+	Lox::Op instruction = static_cast<Lox::Op>(code[offset]);
 	switch (instruction)
 	{
 		case Lox::Op::CONSTANT:
 		{
-			return print_constant_instruction("CONSTANT", offset);
+			return print_constant_instruction("CONSTANT", offset, wide);
 			break;
 		}
 		case Lox::Op::NIL:
@@ -55,52 +66,52 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 		}
 		case Lox::Op::GET_LOCAL:
 		{
-			return print_byte_instruction("GET_LOCAL", offset);
+			return print_byte_instruction("GET_LOCAL", offset, wide);
 			break;
 		}
 		case Lox::Op::SET_LOCAL:
 		{
-			return print_byte_instruction("SET_LOCAL", offset);
+			return print_byte_instruction("SET_LOCAL", offset, wide);
 			break;
 		}
 		case Lox::Op::GET_GLOBAL:
 		{
-			return print_constant_instruction("GET_GLOBAL", offset);
+			return print_constant_instruction("GET_GLOBAL", offset, wide);
 			break;
 		}
 		case Lox::Op::DEFINE_GLOBAL:
 		{
-			return print_constant_instruction("DEFINE_GLOBAL", offset);
+			return print_constant_instruction("DEFINE_GLOBAL", offset, wide);
 			break;
 		}
 		case Lox::Op::SET_GLOBAL:
 		{
-			return print_constant_instruction("SET_GLOBAL", offset);
+			return print_constant_instruction("SET_GLOBAL", offset, wide);
 			break;
 		}
 		case Lox::Op::GET_UPVALUE:
 		{
-			return print_byte_instruction("GET_UPVALUE", offset);
+			return print_byte_instruction("GET_UPVALUE", offset, wide);
 			break;
 		}
 		case Lox::Op::SET_UPVALUE:
 		{
-			return print_byte_instruction("SET_UPVALUE", offset);
+			return print_byte_instruction("SET_UPVALUE", offset, wide);
 			break;
 		}
 		case Lox::Op::GET_PROPERTY:
 		{
-			return print_constant_instruction("GET_PROPERTY", offset);
+			return print_constant_instruction("GET_PROPERTY", offset, wide);
 			break;
 		}
 		case Lox::Op::SET_PROPERTY:
 		{
-			return print_constant_instruction("SET_PROPERTY", offset);
+			return print_constant_instruction("SET_PROPERTY", offset, wide);
 			break;
 		}
 		case Lox::Op::GET_SUPER:
 		{
-			return print_constant_instruction("GET_SUPER", offset);
+			return print_constant_instruction("GET_SUPER", offset, wide);
 		}
 		case Lox::Op::EQUAL:
 		{
@@ -154,47 +165,34 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 		}
 		case Lox::Op::JUMP:
 		{
-			return print_jump_instruction("JUMP", 1, offset);
+			return print_jump_instruction("JUMP", 1, offset, wide);
 			break;
 		}
 		case Lox::Op::JUMP_IF_FALSE:
 		{
-			return print_jump_instruction("JUMP_IF_FALSE", 1, offset);
+			return print_jump_instruction("JUMP_IF_FALSE", 1, offset, wide);
 			break;
 		}
 		case Lox::Op::LOOP:
 		{
-			return print_jump_instruction("LOOP", -1, offset);
+			return print_jump_instruction("LOOP", -1, offset, wide);
 			break;
 		}
 		case Lox::Op::CALL:
 		{
-			return print_byte_instruction("CALL", offset);
+			return print_byte_instruction("CALL", offset, false);
 		}
 		case Lox::Op::INVOKE:
 		{
-			return print_invoke_instruction("INVOKE", offset);
+			return print_invoke_instruction("INVOKE", offset, wide);
 		}
 		case Lox::Op::SUPER_INVOKE:
 		{
-			return print_invoke_instruction("SUPER_INVOKE", offset);
+			return print_invoke_instruction("SUPER_INVOKE", offset, wide);
 		}
 		case Lox::Op::CLOSURE:
 		{
-			offset++;
-			u8 const_index = code[offset++];
-			std::cout << std::format("CLOSURE {} {}", const_index, to_string(constants[const_index])) << std::endl;
-
-			ObjectFunction* function = as_function(constants[const_index]);
-			for (i32 j = 0; j < function->upvalue_count; ++j)
-			{
-				i32 is_local = code[offset++];
-				i32 index = code[offset++];
-
-				std::cout << std::format("{:04}                {} {}", offset - 2, is_local ? "local" : "upvalue", index) << std::endl;
-			}
-
-			return offset;
+			return print_closure_instruction(offset, wide);
 		}
 		case Lox::Op::CLOSE_UPVALUE:
 		{
@@ -208,7 +206,7 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 		}
 		case Lox::Op::CLASS:
 		{
-			return print_constant_instruction("CLASS", offset);
+			return print_constant_instruction("CLASS", offset, wide);
 			break;
 		}
 		case Lox::Op::INHERIT:
@@ -217,7 +215,7 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 		}
 		case Lox::Op::METHOD:
 		{
-			return print_constant_instruction("METHOD", offset);
+			return print_constant_instruction("METHOD", offset, wide);
 			break;
 		}
 		default:
@@ -231,52 +229,107 @@ i32 Lox::Chunk::disassemble_instruction(i32 offset) const
 void Lox::Chunk::write_chunk(u8 byte, u32 line)
 {
 	code.push_back(byte);
-	lines.push_back(line);
+
+	if (lines.empty() || lines.back().line != line)
+	{
+		lines.push_back({(i32)(code.size() - 1), line});
+	}
 }
 
 i32 Lox::Chunk::add_constant(Value value)
 {
-	Lox::push(value);	 // Mark the potential Lox::Object as a GC root before constants reallocates and triggers GC
 	constants.push_back(value);
-	Lox::pop();
 	return (i32)(constants.size() - 1);
 }
 
+u32 Lox::Chunk::get_line(i32 offset) const
+{
+	// Find the last run that starts at or before offset
+	auto iter = std::upper_bound(
+		lines.begin(),
+		lines.end(),
+		offset,
+		[](i32 target_offset, const LineStart& line_start)
+		{
+			return target_offset < line_start.offset;
+		}
+	);
+
+	if (iter == lines.begin())
+	{
+		return 0;
+	}
+
+	return std::prev(iter)->line;
+}
+
+u32 Lox::Chunk::read_operand(i32 offset, bool wide) const
+{
+	if (wide)
+	{
+		return (u32)(code[offset] << 16) | (u32)(code[offset + 1] << 8) | (u32)code[offset + 2];
+	}
+
+	return code[offset];
+}
+
 i32 Lox::Chunk::print_simple_instruction(const char* op_name, i32 offset) const
 {
 	std::cout << op_name << std::endl;
 	return offset + 1;
 }
 
-i32 Lox::Chunk::print_constant_instruction(const char* op_name, i32 offset) const
+i32 Lox::Chunk::print_constant_instruction(const char* op_name, i32 offset, bool wide) const
 {
-	u8 constant_index = code[offset + 1];
+	u32 constant_index = read_operand(offset + 1, wide);
 	std::cout << op_name << " ";
 	std::cout << std::to_string(constant_index) << " '";
 	std::cout << to_string(constants[constant_index]) << "'" << std::endl;
-	return offset + 2;
+	return offset + 1 + (wide ? 3 : 1);
 }
 
-i32 Lox::Chunk::print_byte_instruction(const char* op_name, i32 offset) const
+i32 Lox::Chunk::print_byte_instruction(const char* op_name, i32 offset, bool wide) const
 {
-	u8 slot = code[offset + 1];
+	u32 slot = read_operand(offset + 1, wide);
 	std::cout << std::format("{} {}", op_name, slot) << std::endl;
-	return offset + 2;
+	return offset + 1 + (wide ? 3 : 1);
 }
 
-i32 Lox::Chunk::print_jump_instruction(const char* op_name, i32 sign, i32 offset) const
+i32 Lox::Chunk::print_jump_instruction(const char* op_name, i32 sign, i32 offset, bool wide) const
 {
-	u16 jump = (u16)(code[offset + 1] << 8);
-	jump |= code[offset + 2];
-
-	std::cout << std::format("{} {} -> {}", op_name, offset, offset + 3 + sign * jump) << std::endl;
-	return offset + 3;
+	i32 jump = wide ? (i32)read_operand(offset + 1, true) : (i32)((code[offset + 1] << 8) | code[offset + 2]);
+	i32 next = offset + 1 + (wide ? 3 : 2);
+	std::cout << std::format("{} {} -> {}", op_name, offset, next + sign * jump) << std::endl;
+	return next;
 }
 
-i32 Lox::Chunk::print_invoke_instruction(const char* op_name, i32 offset) const
+i32 Lox::Chunk::print_invoke_instruction(const char* op_name, i32 offset, bool wide) const
 {
-	u8 constant = code[offset + 1];
-	u8 arg_count = code[offset + 2];
+	u32 constant = read_operand(offset + 1, wide);
+	offset += 1 + (wide ? 3 : 1);
+
+	u8 arg_count = code[offset];
 	std::cout << std::format("{} ({} args) {} '{}'\n", op_name, arg_count, constant, Lox::to_string(constants[constant]));
-	return offset + 3;
+	return offset + 1;
+}
+
+i32 Lox::Chunk::print_closure_instruction(i32 offset, bool wide) const
+{
+	const i32 operand_size = wide ? 3 : 1;
+
+	u32 const_index = read_operand(offset + 1, wide);
+	offset += 1 + operand_size;
+	std::cout << std::format("CLOSURE {} {}", const_index, to_string(constants[const_index])) << std::endl;
+
+	ObjectFunction* function = as_function(constants[const_index]);
+	for (i32 j = 0; j < function->upvalue_count; ++j)
+	{
+		i32 is_local = code[offset];
+		u32 index = read_operand(offset + 1, wide);
+
+		std::cout << std::format("{:04}                {} {}", offset, is_local ? "local" : "upvalue", index) << std::endl;
+		offset += 1 + operand_size;
+	}
+
+	return offset;
 }
@@ -5,6 +5,15 @@
 
 #include <vector>
 
+// Bump this whenever the encoding of Op or the layout of Chunk changes, so that
+// stale bytecode cache files get ignored and the scripts recompiled
+#define BYTECODE_VERSION 5
+
+// Index operands (constants, local and upvalue slots) normally take a single byte and jump offsets two,
+// but either can be prefixed with Op::WIDE to take three bytes instead
+#define OPERAND_WIDE_MAX 0xFFFFFF
+#define JUMP_MAX 0xFFFF
+
 namespace Lox
 {
 	enum class Op : u8
@@ -45,15 +54,24 @@ namespace Lox
 		RETURN,
 		CLASS,
 		INHERIT,
-		METHOD
+		METHOD,
+		WIDE	// Makes the operands of the next instruction 24-bit instead of 8-bit, or 16-bit for jumps
+	};
+
+	// Marks the first bytecode offset that was compiled from a given source line. Each run of bytes
+	// from the same line only gets one of these, instead of storing a line number for every single byte
+	struct LineStart
+	{
+		i32 offset = 0;
+		u32 line = 0;
 	};
 
 	class Chunk
 	{
 	public:
-		Lox::Vec<u8> code;
-		Lox::Vec<u32> lines;
-		Lox::Vec<Value> constants;
+		Lox::Vec<u8, HeapUse::CHUNKS> code;
+		Lox::Vec<LineStart, HeapUse::CHUNKS> lines;
+		Lox::Vec<Value, HeapUse::CHUNKS> constants;
 
 	public:
 		void disassemble_chunk(const char* chunk_name) const;
@@ -62,11 +80,17 @@ namespace Lox
 		void write_chunk(u8 byte, u32 line);
 		i32 add_constant(Value value);
 
+		// Only meant for error reporting, disassembly and profiling, as it needs a binary search
+		u32 get_line(i32 offset) const;
+
 	private:
+		u32 read_operand(i32 offset, bool wide) const;
+
 		i32 print_simple_instruction(const char* op_name, i32 offset) const;
-		i32 print_constant_instruction(const char* op_name, i32 offset) const;
-		i32 print_byte_instruction(const char* op_name, i32 offset) const;
-		i32 print_jump_instruction(const char* op_name, i32 sign, i32 offset) const;
-		i32 print_invoke_instruction(const char* op_name, i32 offset) const;
+		i32 print_constant_instruction(const char* op_name, i32 offset, bool wide) const;
+		i32 print_byte_instruction(const char* op_name, i32 offset, bool wide) const;
+		i32 print_jump_instruction(const char* op_name, i32 sign, i32 offset, bool wide) const;
+		i32 print_invoke_instruction(const char* op_name, i32 offset, bool wide) const;
+		i32 print_closure_instruction(i32 offset, bool wide) const;
 	};
 }	 // namespace Lox
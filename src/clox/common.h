@@ -24,18 +24,18 @@ using f64 = double;
 
 namespace Lox
 {
-	template<typename T>
-	using Vec = std::vector<T, Lox::TrackingAllocator<T>>;
-
-	using String = std::basic_string<char, std::char_traits<char>, Lox::TrackingAllocator<char>>;
-
-	// Not really used because we can seem to iterate these maps while
-	// one of their internal nodes is being allocated, which we need to for GC
-	// template<typename TKey, typename TVal>
-	// using Map = std::unordered_map<	   //
-	// 	TKey,
-	// 	TVal,
-	// 	std::hash<TKey>,
-	// 	std::equal_to<TKey>,
-	// 	Lox::TrackingAllocator<std::pair<const TKey, TVal>>>;
+	template<typename T, HeapUse USE>
+	using Vec = std::vector<T, Lox::TrackingAllocator<T, USE>>;
+
+	using String = std::basic_string<char, std::char_traits<char>, Lox::TrackingAllocator<char, HeapUse::STRINGS>>;
+
+	// Allocating never collects garbage by itself, only safepoints do, so the collector can't run into one of these
+	// while it's halfway through allocating its internal nodes
+	template<typename TKey, typename TVal, HeapUse USE>
+	using Map = std::unordered_map<	   //
+		TKey,
+		TVal,
+		std::hash<TKey>,
+		std::equal_to<TKey>,
+		Lox::TrackingAllocator<std::pair<const TKey, TVal>, USE>>;
 }
@@ -3,15 +3,25 @@
 #include "memory.h"
 #include "object.h"
 #include "scanner.h"
+#include "vm.h"
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
+#include <cstring>
 #include <format>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #define UNINITIALIZED -1
 
+// Locals live on the VM stack, so make sure a single function can't use up all of it
+#define LOCALS_MAX (STACK_MAX / 4)
+#define UPVALUES_MAX (UINT16_MAX + 1)
+
 namespace CompilerImpl
 {
 	using namespace Lox;
@@ -57,7 +67,7 @@ namespace CompilerImpl
 
 	struct Upvalue
 	{
-		u8 index;		  // Which local slot is captured
+		i32 index;		  // Which local slot is captured
 		bool is_local;	  // True if it's a local variable of the surrounding function; False if it's itself an upvalue
 	};
 
@@ -75,10 +85,19 @@ namespace CompilerImpl
 		ObjectFunction* function = nullptr;
 		FunctionType type;
 
-		std::array<Local, UINT8_MAX + 1> locals;
+		// These only ever grow, while local_count moves up and down as scopes come and go
+		std::vector<Local> locals;
 		i32 local_count = 0;
-		Upvalue upvalues[UINT8_MAX + 1];
+		std::vector<Upvalue> upvalues;
 		i32 scope_depth = 0;
+
+		// Indices of the constants already in this function's chunk, so that repeated literals and names share
+		// a single entry. Numbers are keyed by their bit pattern, strings by pointer since they're all interned
+		std::unordered_map<u64, i32> number_constants;
+		std::unordered_map<const ObjectString*, i32> string_constants;
+
+		// Where every jump and loop in this function's chunk starts, in order, for narrow_jumps() to revisit them
+		std::vector<i32> jumps;
 	};
 
 	struct ClassCompiler
@@ -103,11 +122,21 @@ namespace CompilerImpl
 	void expression_statement();
 	void begin_scope();
 	void end_scope();
-	u8 parse_variable(const char* error_message);
+	i32 parse_variable(const char* error_message);
 	void declare_variable();
-	void define_variable(u8 global_index);
+	void define_variable(i32 global_index);
 	void add_local(const Token& var_name);
 
+	Local* push_local(Compiler* compiler)
+	{
+		if (compiler->local_count == (i32)compiler->locals.size())
+		{
+			compiler->locals.emplace_back();
+		}
+
+		return &compiler->locals[compiler->local_count++];
+	}
+
 	void init_compiler(Compiler* compiler, FunctionType type)
 	{
 		compiler->enclosing = current_compiler;
@@ -125,7 +154,7 @@ namespace CompilerImpl
 		}
 
 		// The compiler implicitly claims stack slot zero for the VM's internal use
-		Local* local = &current_compiler->locals[current_compiler->local_count++];
+		Local* local = push_local(current_compiler);
 		local->depth = 0;
 		local->is_captured = false;
 		if (type != FunctionType::FUNCTION)
@@ -225,19 +254,41 @@ namespace CompilerImpl
 		return &current_compiler->function->chunk;
 	}
 
-	u8 make_constant(Value value)
+	i32 make_constant(Value value)
 	{
+		i32* cached_index = nullptr;
+		if (is_number(value))
+		{
+			auto [iter, inserted] = current_compiler->number_constants.try_emplace(std::bit_cast<u64>(as_number(value)), -1);
+			cached_index = &iter->second;
+		}
+		else if (is_string(value))
+		{
+			auto [iter, inserted] = current_compiler->string_constants.try_emplace(as_string(value), -1);
+			cached_index = &iter->second;
+		}
+
+		if (cached_index != nullptr && *cached_index != -1)
+		{
+			return *cached_index;
+		}
+
 		int index = current_chunk()->add_constant(value);
-		if (index > UINT8_MAX)
+		if (index > OPERAND_WIDE_MAX)
 		{
 			error("Too many constants in one chunk");
 			return 0;
 		}
 
-		return (u8)index;
+		if (cached_index != nullptr)
+		{
+			*cached_index = index;
+		}
+
+		return index;
 	}
 
-	u8 identifier_constant(const Token& name)
+	i32 identifier_constant(const Token& name)
 	{
 		Lox::ObjectString* new_str = Lox::ObjectString::allocate(Lox::String{name.start, (size_t)name.length});
 		return make_constant(new_str);
@@ -277,7 +328,7 @@ namespace CompilerImpl
 		return -1;
 	}
 
-	i32 add_upvalue(Compiler* compiler, u8 index, bool is_local)
+	i32 add_upvalue(Compiler* compiler, i32 index, bool is_local)
 	{
 		i32 upvalue_count = compiler->function->upvalue_count;
 
@@ -291,14 +342,13 @@ namespace CompilerImpl
 			}
 		}
 
-		if (upvalue_count == UINT8_MAX + 1)
+		if (upvalue_count == UPVALUES_MAX)
 		{
 			error("Too many closure variables in function");
 			return 0;
 		}
 
-		compiler->upvalues[upvalue_count].is_local = is_local;
-		compiler->upvalues[upvalue_count].index = index;
+		compiler->upvalues.push_back(Upvalue{index, is_local});
 		return compiler->function->upvalue_count++;
 	}
 
@@ -313,13 +363,13 @@ namespace CompilerImpl
 		if (local != -1)
 		{
 			compiler->enclosing->locals[local].is_captured = true;
-			return add_upvalue(compiler, (u8)local, true);
+			return add_upvalue(compiler, local, true);
 		}
 
 		i32 upvalue = resolve_upvalue(compiler->enclosing, name);
 		if (upvalue != -1)
 		{
-			return add_upvalue(compiler, (u8)upvalue, false);
+			return add_upvalue(compiler, upvalue, false);
 		}
 
 		return -1;
@@ -336,26 +386,60 @@ namespace CompilerImpl
 		emit_byte(b2);
 	}
 
+	void emit_wide_operand(i32 operand)
+	{
+		emit_byte((operand >> 16) & 0xFF);
+		emit_byte((operand >> 8) & 0xFF);
+		emit_byte(operand & 0xFF);
+	}
+
+	// Emits an instruction that takes an index (constant, local slot, upvalue slot) as operand. The index
+	// takes a single byte whenever possible, and we fall back to a WIDE prefix and a 24-bit index otherwise
+	void emit_indexed(Op instruction, i32 index)
+	{
+		if (index <= UINT8_MAX)
+		{
+			emit_bytes((u8)instruction, (u8)index);
+		}
+		else
+		{
+			emit_bytes((u8)Op::WIDE, (u8)instruction);
+			emit_wide_operand(index);
+		}
+	}
+
+	// How far a forward jump goes is only known once it's patched, so it always starts out with a WIDE prefix,
+	// and narrow_jumps() takes that back off again when it wasn't needed after all
 	i32 emit_jump(Op instruction)
 	{
-		emit_byte((u8)instruction);
-		emit_byte(0xFF);
-		emit_byte(0xFF);
-		return static_cast<i32>(current_chunk()->code.size() - 2);
+		current_compiler->jumps.push_back((i32)current_chunk()->code.size());
+		emit_bytes((u8)Op::WIDE, (u8)instruction);
+		emit_wide_operand(OPERAND_WIDE_MAX);
+		return static_cast<i32>(current_chunk()->code.size() - 3);
 	}
 
+	// Loops already know how far back they go, so like emit_indexed() they only take a WIDE prefix when needed.
+	// The +3 and +5 account for the loop instruction itself
 	void emit_loop(i32 loop_start)
 	{
-		emit_byte((u8)Op::LOOP);
+		current_compiler->jumps.push_back((i32)current_chunk()->code.size());
+
+		i32 offset = (i32)(current_chunk()->code.size() - loop_start + 3);
+		if (offset <= JUMP_MAX)
+		{
+			emit_byte((u8)Op::LOOP);
+			emit_bytes((offset >> 8) & 0xFF, offset & 0xFF);
+			return;
+		}
 
-		i32 offset = (i32)(current_chunk()->code.size() - loop_start + 2);
-		if (offset > UINT16_MAX)
+		offset += 2;
+		if (offset > OPERAND_WIDE_MAX)
 		{
 			error("Loop body too large");
 		}
 
-		emit_byte((offset >> 8) & 0xFF);
-		emit_byte(offset & 0xFF);
+		emit_bytes((u8)Op::WIDE, (u8)Op::LOOP);
+		emit_wide_operand(offset);
 	}
 
 	void emit_return()
@@ -375,27 +459,153 @@ namespace CompilerImpl
 
 	void emit_constant(Value value)
 	{
-		emit_bytes((u8)Op::CONSTANT, make_constant(value));
+		emit_indexed(Op::CONSTANT, make_constant(value));
 	}
 
 	void patch_jump(i32 offset)
 	{
-		// -2 to adjust for the bytecode for the jump offset itself
-		i32 distance = (i32)(current_chunk()->code.size() - offset - 2);
+		// -3 to adjust for the bytecode for the jump offset itself
+		i32 distance = (i32)(current_chunk()->code.size() - offset - 3);
 
-		if (distance > UINT16_MAX)
+		if (distance > OPERAND_WIDE_MAX)
 		{
 			error("Too much code to jump over");
 		}
 
-		current_chunk()->code[offset + 0] = (distance >> 8) & 0xFF;
-		current_chunk()->code[offset + 1] = (distance >> 0) & 0xFF;
+		current_chunk()->code[offset + 0] = (distance >> 16) & 0xFF;
+		current_chunk()->code[offset + 1] = (distance >> 8) & 0xFF;
+		current_chunk()->code[offset + 2] = (distance >> 0) & 0xFF;
+	}
+
+	// Once the whole function is compiled, every jump that fits in two bytes drops its WIDE prefix and a byte of its
+	// offset. That moves the code after it closer, which can let more jumps fit, so this repeats until none do and only
+	// then moves the code and the line starts
+	void narrow_jumps()
+	{
+		// Jumps that were never patched don't know where they go, and the chunk gets thrown away anyway
+		if (parser.had_error)
+		{
+			return;
+		}
+
+		struct Jump
+		{
+			i32 offset = 0;
+			i32 target = 0;
+			Op instruction = Op::JUMP;
+			bool was_wide = false;
+			bool wide = false;
+		};
+
+		Chunk* chunk = current_chunk();
+		std::vector<Jump> jumps;
+		for (i32 offset : current_compiler->jumps)
+		{
+			Jump& jump = jumps.emplace_back();
+			jump.offset = offset;
+			jump.was_wide = jump.wide = chunk->code[offset] == (u8)Op::WIDE;
+
+			i32 operand_offset = offset + (jump.wide ? 2 : 1);
+			i32 operand_size = jump.wide ? 3 : 2;
+			jump.instruction = static_cast<Op>(chunk->code[operand_offset - 1]);
+
+			i32 distance = 0;
+			for (i32 index = 0; index < operand_size; ++index)
+			{
+				distance = (distance << 8) | chunk->code[operand_offset + index];
+			}
+
+			i32 next = operand_offset + operand_size;
+			jump.target = jump.instruction == Op::LOOP ? next - distance : next + distance;
+		}
+
+		// removed[index] is how many bytes all the jumps before jumps[index] gave up
+		std::vector<i32> removed(jumps.size() + 1, 0);
+		auto count_removed = [&]()
+		{
+			for (std::size_t index = 0; index < jumps.size(); ++index)
+			{
+				removed[index + 1] = removed[index] + ((jumps[index].was_wide && !jumps[index].wide) ? 2 : 0);
+			}
+		};
+
+		auto moved = [&](i32 offset)
+		{
+			auto iter = std::lower_bound(jumps.begin(), jumps.end(), offset, [](const Jump& jump, i32 value) { return jump.offset < value; });
+			return offset - removed[iter - jumps.begin()];
+		};
+
+		// Like in the VM, the distance counts from the end of the jump
+		auto distance = [&](const Jump& jump)
+		{
+			i32 next = moved(jump.offset) + (jump.wide ? 5 : 3);
+			return jump.instruction == Op::LOOP ? next - moved(jump.target) : moved(jump.target) - next;
+		};
+
+		bool narrowed = true;
+		while (narrowed)
+		{
+			narrowed = false;
+			count_removed();
+
+			// Dropping the prefix brings the end of a loop closer to where it goes back to, while the target of a forward
+			// jump moves along with its end. Jumps narrowed earlier in the same pass only make this overestimate
+			for (Jump& jump : jumps)
+			{
+				if (jump.wide && distance(jump) - (jump.instruction == Op::LOOP ? 2 : 0) <= JUMP_MAX)
+				{
+					jump.wide = false;
+					narrowed = true;
+				}
+			}
+		}
+
+		if (removed.back() == 0)
+		{
+			return;
+		}
+
+		// Everything only ever moves towards the start, so the code can be compacted in place
+		Lox::Vec<u8, HeapUse::CHUNKS>& code = chunk->code;
+		i32 write = 0;
+		i32 read = 0;
+		for (const Jump& jump : jumps)
+		{
+			std::memmove(code.data() + write, code.data() + read, jump.offset - read);
+			write += jump.offset - read;
+
+			i32 jump_distance = distance(jump);
+			if (jump.wide)
+			{
+				code[write++] = (u8)Op::WIDE;
+				code[write++] = (u8)jump.instruction;
+				code[write++] = (jump_distance >> 16) & 0xFF;
+			}
+			else
+			{
+				code[write++] = (u8)jump.instruction;
+			}
+			code[write++] = (jump_distance >> 8) & 0xFF;
+			code[write++] = jump_distance & 0xFF;
+
+			read = jump.offset + (jump.was_wide ? 5 : 3);
+		}
+		std::memmove(code.data() + write, code.data() + read, code.size() - read);
+		code.resize(write + code.size() - read);
+
+		for (LineStart& line_start : chunk->lines)
+		{
+			line_start.offset = moved(line_start.offset);
+		}
 	}
 
 	ObjectFunction* end_compiler()
 	{
 		emit_return();
+		narrow_jumps();
 		ObjectFunction* function = current_compiler->function;
+		function->max_slots = count_max_slots(function);
+		assert(function->max_slots > 0 || parser.had_error);
 
 #if DEBUG_PRINT_CODE
 		if (!parser.had_error)
@@ -545,22 +755,22 @@ namespace CompilerImpl
 	void dot(bool can_assign)
 	{
 		consume(TokenType::IDENTIFIER, "Expected property name after '.'");
-		u8 prop_name_index = identifier_constant(parser.previous);
+		i32 prop_name_index = identifier_constant(parser.previous);
 
 		if (can_assign && match(TokenType::EQUAL))
 		{
 			expression();
-			emit_bytes((u8)Op::SET_PROPERTY, prop_name_index);
+			emit_indexed(Op::SET_PROPERTY, prop_name_index);
 		}
 		else if (match(TokenType::LEFT_PAREN))
 		{
 			u8 arg_count = argument_list();
-			emit_bytes((u8)Op::INVOKE, prop_name_index);
+			emit_indexed(Op::INVOKE, prop_name_index);
 			emit_byte(arg_count);
 		}
 		else
 		{
-			emit_bytes((u8)Op::GET_PROPERTY, prop_name_index);
+			emit_indexed(Op::GET_PROPERTY, prop_name_index);
 		}
 	}
 
@@ -636,11 +846,11 @@ namespace CompilerImpl
 		if (can_assign && match(TokenType::EQUAL))
 		{
 			expression();
-			emit_bytes((u8)set_op, (u8)op_arg);
+			emit_indexed(set_op, op_arg);
 		}
 		else
 		{
-			emit_bytes((u8)get_op, (u8)op_arg);
+			emit_indexed(get_op, op_arg);
 		}
 	}
 
@@ -670,20 +880,20 @@ namespace CompilerImpl
 
 		consume(TokenType::DOT, "Expected '.' after 'super'");
 		consume(TokenType::IDENTIFIER, "Expected superclass method name");
-		u8 name = identifier_constant(parser.previous);
+		i32 name = identifier_constant(parser.previous);
 
 		named_variable(synthetic_token("this"), false);
 		if(match(TokenType::LEFT_PAREN))
 		{
 			u8 arg_count = argument_list();
 			named_variable(synthetic_token("super"), false);
-			emit_bytes((u8)Op::SUPER_INVOKE, name);
+			emit_indexed(Op::SUPER_INVOKE, name);
 			emit_byte(arg_count);
 		}
 		else
 		{
 			named_variable(synthetic_token("super"), false);
-			emit_bytes((u8)Op::GET_SUPER, name);
+			emit_indexed(Op::GET_SUPER, name);
 		}
 	}
 
@@ -1012,7 +1222,7 @@ namespace CompilerImpl
 					error_at_current("Can't have more than 255 parameters");
 				}
 
-				u8 constant = parse_variable("Expected parameter name");
+				i32 constant = parse_variable("Expected parameter name");
 				define_variable(constant);
 			} while (match(TokenType::COMMA));
 		}
@@ -1023,19 +1233,33 @@ namespace CompilerImpl
 		block();
 
 		ObjectFunction* function = end_compiler();
-		emit_bytes((u8)Op::CLOSURE, make_constant(function));
+		i32 function_index = make_constant(function);
+
+		// The upvalue indices share the WIDE prefix with the function constant, so go wide if any of them needs it
+		bool wide = function_index > UINT8_MAX;
+		for (i32 i = 0; i < function->upvalue_count; ++i)
+		{
+			wide = wide || compiler.upvalues[i].index > UINT8_MAX;
+		}
+
+		if (wide)
+		{
+			emit_byte((u8)Op::WIDE);
+		}
+		emit_byte((u8)Op::CLOSURE);
+		wide ? emit_wide_operand(function_index) : emit_byte((u8)function_index);
 
 		for (i32 i = 0; i < function->upvalue_count; ++i)
 		{
 			emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-			emit_byte(compiler.upvalues[i].index);
+			wide ? emit_wide_operand(compiler.upvalues[i].index) : emit_byte((u8)compiler.upvalues[i].index);
 		}
 	}
 
 	void method()
 	{
 		consume(TokenType::IDENTIFIER, "Expected method name");
-		u8 method_name_index = identifier_constant(parser.previous);
+		i32 method_name_index = identifier_constant(parser.previous);
 
 		FunctionType type = FunctionType::METHOD;
 		if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
@@ -1044,17 +1268,17 @@ namespace CompilerImpl
 		}
 		function(type);
 
-		emit_bytes((u8)Op::METHOD, method_name_index);
+		emit_indexed(Op::METHOD, method_name_index);
 	}
 
 	void class_declaration()
 	{
 		consume(TokenType::IDENTIFIER, "Expected class name");
 		Token class_name = parser.previous;
-		u8 name_index = identifier_constant(parser.previous);
+		i32 name_index = identifier_constant(parser.previous);
 		declare_variable();
 
-		emit_bytes((u8)Op::CLASS, name_index);
+		emit_indexed(Op::CLASS, name_index);
 		define_variable(name_index);
 
 		ClassCompiler class_compiler;
@@ -1162,13 +1386,13 @@ namespace CompilerImpl
 
 	void add_local(const Token& var_name)
 	{
-		if (current_compiler->local_count == UINT8_MAX + 1)
+		if (current_compiler->local_count == LOCALS_MAX)
 		{
 			error("Too many local variables");
 			return;
 		}
 
-		Local* local = &current_compiler->locals[current_compiler->local_count++];
+		Local* local = push_local(current_compiler);
 		local->name = var_name;
 		local->depth = current_compiler->scope_depth;
 		local->is_captured = false;
@@ -1212,7 +1436,7 @@ namespace CompilerImpl
 		add_local(var_name);
 	}
 
-	void define_variable(u8 global_index)
+	void define_variable(i32 global_index)
 	{
 		// Don't need to do anything at runtime: The temporary for the variable's value
 		// is already in the stack anyway
@@ -1222,7 +1446,7 @@ namespace CompilerImpl
 			return;
 		}
 
-		emit_bytes((u8)Op::DEFINE_GLOBAL, global_index);
+		emit_indexed(Op::DEFINE_GLOBAL, global_index);
 	}
 
 	void and_([[maybe_unused]] bool can_assign)
@@ -1247,7 +1471,7 @@ namespace CompilerImpl
 		patch_jump(end_jump);
 	}
 
-	u8 parse_variable(const char* error_message)
+	i32 parse_variable(const char* error_message)
 	{
 		consume(TokenType::IDENTIFIER, error_message);
 
@@ -1264,7 +1488,7 @@ namespace CompilerImpl
 
 	void fun_declaration()
 	{
-		u8 global = parse_variable("Expected function name");
+		i32 global = parse_variable("Expected function name");
 		mark_initialized();
 		function(FunctionType::FUNCTION);
 		define_variable(global);
@@ -1272,7 +1496,7 @@ namespace CompilerImpl
 
 	void var_declaration()
 	{
-		u8 global_index = parse_variable("Expected variable name");
+		i32 global_index = parse_variable("Expected variable name");
 
 		if (match(TokenType::EQUAL))
 		{
@@ -1290,6 +1514,9 @@ namespace CompilerImpl
 
 	void declaration()
 	{
+		// Everything compiled so far is reachable from the functions of current_compiler and its enclosing compilers
+		maybe_collect_garbage();
+
 		if (match(TokenType::CLASS))
 		{
 			class_declaration();
@@ -1327,15 +1554,28 @@ Lox::ObjectFunction* Lox::compile(const char* source)
 	parser.had_error = false;
 	parser.panic_mode = false;
 
-	advance();
-
-	while (!match(TokenType::EOF_))
+	try
 	{
-		declaration();
+		advance();
+
+		while (!match(TokenType::EOF_))
+		{
+			declaration();
+		}
+
+		ObjectFunction* function = end_compiler();
+		return parser.had_error ? nullptr : function;
 	}
+	catch (const HeapLimitExceeded&)
+	{
+		// The compilers of any enclosing functions and classes were on the stack we just unwound
+		current_compiler = nullptr;
+		current_class = nullptr;
 
-	ObjectFunction* function = end_compiler();
-	return parser.had_error ? nullptr : function;
+		parser.panic_mode = false;
+		error("Out of memory");
+		return nullptr;
+	}
 }
 
 void Lox::mark_compiler_roots()
@@ -1349,3 +1589,260 @@ void Lox::mark_compiler_roots()
 		compiler = compiler->enclosing;
 	}
 }
+
+i32 Lox::count_max_slots(const ObjectFunction* function)
+{
+	const Chunk& chunk = function->chunk;
+	const i32 code_size = (i32)chunk.code.size();
+
+	// Stack depth on entry to each instruction, or -1 where none starts, and the depths that forward jumps expect
+	std::vector<i32> depths(code_size, -1);
+	std::unordered_map<i32, i32> jump_depths;
+
+	i32 offset = 0;
+	i32 operand_size = 1;
+	bool widens_operand = false;
+
+	auto read_operand = [&](i32 size, u32& operand)
+	{
+		if (offset + size > code_size)
+		{
+			return false;
+		}
+
+		operand = 0;
+		for (i32 index = 0; index < size; ++index)
+		{
+			operand = (operand << 8) | chunk.code[offset++];
+		}
+		return true;
+	};
+
+	// Only index operands and jump offsets can be widened, so a WIDE prefix in front of anything else is invalid
+	auto read_constant = [&](bool (*is_type)(const Value&), u32& index)
+	{
+		widens_operand = true;
+		return read_operand(operand_size, index) && index < chunk.constants.size() && (is_type == nullptr || is_type(chunk.constants[index]));
+	};
+
+	i32 depth = function->arity + 1;
+	i32 max_depth = depth;
+	bool falls_through = true;
+
+	while (offset < code_size)
+	{
+		if (auto iter = jump_depths.find(offset); iter != jump_depths.end())
+		{
+			if (falls_through && depth != iter->second)
+			{
+				return -1;
+			}
+			depth = iter->second;
+		}
+		depths[offset] = depth;
+
+		Op instruction = static_cast<Op>(chunk.code[offset++]);
+		operand_size = 1;
+		widens_operand = false;
+		falls_through = true;
+
+		if (instruction == Op::WIDE && offset < code_size)
+		{
+			instruction = static_cast<Op>(chunk.code[offset++]);
+			operand_size = 3;
+		}
+
+		u32 operand = 0;
+		switch (instruction)
+		{
+			case Op::CONSTANT:
+			{
+				if (!read_constant(nullptr, operand))
+				{
+					return -1;
+				}
+				++depth;
+				break;
+			}
+			case Op::NIL:
+			case Op::TRUE:
+			case Op::FALSE:
+			{
+				++depth;
+				break;
+			}
+			case Op::POP:
+			case Op::EQUAL:
+			case Op::GREATER:
+			case Op::LESS:
+			case Op::ADD:
+			case Op::SUBTRACT:
+			case Op::MULTIPLY:
+			case Op::DIVIDE:
+			case Op::PRINT:
+			case Op::CLOSE_UPVALUE:
+			case Op::INHERIT:
+			{
+				--depth;
+				break;
+			}
+			case Op::NOT:
+			case Op::NEGATE:
+			{
+				break;
+			}
+			case Op::GET_LOCAL:
+			case Op::SET_LOCAL:
+			{
+				widens_operand = true;
+				if (!read_operand(operand_size, operand) || operand >= (u32)depth)
+				{
+					return -1;
+				}
+				depth += instruction == Op::GET_LOCAL ? 1 : 0;
+				break;
+			}
+			case Op::GET_UPVALUE:
+			case Op::SET_UPVALUE:
+			{
+				widens_operand = true;
+				if (!read_operand(operand_size, operand) || operand >= (u32)function->upvalue_count)
+				{
+					return -1;
+				}
+				depth += instruction == Op::GET_UPVALUE ? 1 : 0;
+				break;
+			}
+			case Op::GET_GLOBAL:
+			case Op::CLASS:
+			case Op::SET_GLOBAL:
+			case Op::GET_PROPERTY:
+			case Op::DEFINE_GLOBAL:
+			case Op::SET_PROPERTY:
+			case Op::GET_SUPER:
+			case Op::METHOD:
+			{
+				// All of these name what they work on with a string constant
+				if (!read_constant(is_string, operand))
+				{
+					return -1;
+				}
+
+				if (instruction == Op::GET_GLOBAL || instruction == Op::CLASS)
+				{
+					++depth;
+				}
+				else if (instruction != Op::SET_GLOBAL && instruction != Op::GET_PROPERTY)
+				{
+					--depth;
+				}
+				break;
+			}
+			case Op::JUMP:
+			case Op::JUMP_IF_FALSE:
+			{
+				widens_operand = true;
+				if (!read_operand(operand_size == 3 ? 3 : 2, operand) || offset + (i32)operand >= code_size)
+				{
+					return -1;
+				}
+
+				auto [iter, inserted] = jump_depths.try_emplace(offset + (i32)operand, depth);
+				if (!inserted && iter->second != depth)
+				{
+					return -1;
+				}
+				falls_through = instruction == Op::JUMP_IF_FALSE;
+				break;
+			}
+			case Op::LOOP:
+			{
+				// Loops jump back to code that was already walked, which has to expect the same depth
+				widens_operand = true;
+				if (!read_operand(operand_size == 3 ? 3 : 2, operand) || (i32)operand > offset || offset - (i32)operand >= code_size || depths[offset - operand] != depth)
+				{
+					return -1;
+				}
+				falls_through = false;
+				break;
+			}
+			case Op::CALL:
+			{
+				// The callee and its arguments are replaced by the result
+				if (!read_operand(1, operand))
+				{
+					return -1;
+				}
+				depth -= (i32)operand;
+				break;
+			}
+			case Op::INVOKE:
+			case Op::SUPER_INVOKE:
+			{
+				u32 arg_count = 0;
+				if (!read_constant(is_string, operand) || !read_operand(1, arg_count))
+				{
+					return -1;
+				}
+
+				// SUPER_INVOKE pops the superclass on top of the arguments
+				depth -= (i32)arg_count + (instruction == Op::SUPER_INVOKE ? 1 : 0);
+				break;
+			}
+			case Op::CLOSURE:
+			{
+				if (!read_constant(is_function, operand))
+				{
+					return -1;
+				}
+
+				// The upvalue indices share the WIDE prefix of the function constant
+				const ObjectFunction* closed = as_function(chunk.constants[operand]);
+				for (i32 upvalue = 0; upvalue < closed->upvalue_count; ++upvalue)
+				{
+					u32 is_local = 0;
+					u32 index = 0;
+					if (!read_operand(1, is_local) || !read_operand(operand_size, index)
+						|| index >= (u32)(is_local ? depth : function->upvalue_count))
+					{
+						return -1;
+					}
+				}
+				++depth;
+				break;
+			}
+			case Op::RETURN:
+			{
+				--depth;
+				falls_through = false;
+				break;
+			}
+			default:
+			{
+				return -1;
+			}
+		}
+
+		// Slot zero holds the function being called until it returns, and nothing ever pops it
+		if ((operand_size == 3 && !widens_operand) || depth < 1)
+		{
+			return -1;
+		}
+		max_depth = std::max(max_depth, depth);
+	}
+
+	// Running off the end of the code, or jumping into the middle of an instruction
+	if (falls_through)
+	{
+		return -1;
+	}
+	for (const auto& [target, target_depth] : jump_depths)
+	{
+		if (depths[target] != target_depth)
+		{
+			return -1;
+		}
+	}
+
+	return max_depth;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "common.h"
+
 namespace Lox
 {
 	class Chunk;
@@ -7,4 +9,9 @@ namespace Lox
 
 	ObjectFunction* compile(const char* source);
 	void mark_compiler_roots();
+
+	// Walks the bytecode of a function to find the most stack slots it can use at once, counting slot zero and the
+	// parameters, which the VM checks for before each call. Returns -1 for bytecode the compiler can't have produced,
+	// like that of a damaged cache file, which would have the VM read past its chunk, its constants or the stack
+	i32 count_max_slots(const ObjectFunction* function);
 }
@@ -4,4 +4,28 @@
 #define DEBUG_PRINT_CODE 0
 #define DEBUG_LOG_GC 0
 #define DEBUG_STRESS_GC 0
-#define GC_HEAP_GROW_FACTOR 2
\ No newline at end of file
+#define GC_INITIAL_HEAP_SIZE (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP_SIZE 0
+#define GC_MAX_HEAP_SIZE 0
+#define GC_HEAP_LIMIT 0
+#define GC_SNAPSHOT_HEAP_SIZE 0
+#define GC_PACER 1
+#define USE_GENERATIONAL_GC 1
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_REGION_MAX_SIZE (16 * 1024 * 1024)
+#define GC_PAGE_SIZE (256 * 1024)
+#define USE_HUGE_PAGES 0
+#define USE_COMPACTING_GC 1
+#define USE_COMPRESSED_POINTERS 0
+#define GC_COMPACT_THRESHOLD 50
+#define GC_RETAINED_EMPTY_PAGES 4
+#define USE_INCREMENTAL_GC 1
+#define USE_CONCURRENT_GC 0
+#define USE_PARALLEL_GC 0
+#define GC_WORKER_THREADS 0
+#define GC_MAX_PAUSE_US 500
+#define GC_INCREMENTAL_STEP_BYTES (64 * 1024)
+#define ALLOC_PROFILE_SAMPLE_BYTES (512 * 1024)
+#define USE_BYTECODE_CACHE 1
+#define USE_SIMD_SCANNER 1
\ No newline at end of file
@@ -0,0 +1,686 @@
+#include "heap_image.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "mapped_file.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace HeapImageImpl
+{
+	using namespace Lox;
+
+	// Reads as "LOXI" in a hex editor, and rejects images written with the other byte order, just like the bytecode cache
+	constexpr u32 IMAGE_MAGIC = 0x49584F4C;
+	constexpr u32 IMAGE_VERSION = 1;
+	constexpr u32 NO_OBJECT = UINT32_MAX;
+
+	constexpr std::size_t OBJECT_TYPE_COUNT = (std::size_t)ObjectType::FORWARDED;
+
+	enum class ValueTag : u8
+	{
+		NIL,
+		BOOL,
+		NUMBER,
+		OBJECT
+	};
+
+	// The header is followed by a record for each object that creates it, then one for each object that references others
+	// which fills those in, and finally the globals. Creating an object only ever needs objects of the types that come before
+	// its own in ObjectType, like the function of a closure, so the creation records are sorted by type. References are
+	// filled in once every object exists, so they can point anywhere, cycles included
+	struct Header
+	{
+		u32 magic = IMAGE_MAGIC;
+		u32 version = IMAGE_VERSION;
+		u32 bytecode_version = BYTECODE_VERSION;
+		u32 object_count = 0;
+		u32 reference_count = 0;
+		u32 global_count = 0;
+	};
+
+	struct Writer
+	{
+		std::vector<u8> bytes;
+
+		void write_bytes(const void* data, std::size_t length)
+		{
+			const u8* data_bytes = static_cast<const u8*>(data);
+			bytes.insert(bytes.end(), data_bytes, data_bytes + length);
+		}
+
+		template<typename T>
+		void write(const T& value)
+		{
+			write_bytes(&value, sizeof(T));
+		}
+
+		void write_string(std::string_view text)
+		{
+			write<u32>((u32)text.size());
+			write_bytes(text.data(), text.size());
+		}
+	};
+
+	struct Reader
+	{
+		const u8* current = nullptr;
+		const u8* end = nullptr;
+		bool failed = false;
+
+		const u8* read_bytes(std::size_t length)
+		{
+			if (failed || (std::size_t)(end - current) < length)
+			{
+				failed = true;
+				return nullptr;
+			}
+
+			const u8* result = current;
+			current += length;
+			return result;
+		}
+
+		template<typename T>
+		T read()
+		{
+			T value{};
+			if (const u8* data = read_bytes(sizeof(T)))
+			{
+				std::memcpy(&value, data, sizeof(T));
+			}
+			return value;
+		}
+
+		std::string_view read_string()
+		{
+			u32 length = read<u32>();
+			const u8* characters = read_bytes(length);
+			return characters != nullptr ? std::string_view{reinterpret_cast<const char*>(characters), length} : std::string_view{};
+		}
+	};
+
+	// Objects are numbered in the order the globals reach them, and written out in that order as well, which finds the
+	// rest of them along the way
+	struct ImageWriter
+	{
+		std::unordered_map<const Object*, u32> indices;
+		std::vector<Object*> objects;
+
+		std::array<Writer, OBJECT_TYPE_COUNT> creations;
+		Writer references;
+		u32 reference_count = 0;
+		Writer globals;
+		bool failed = false;
+
+		u32 object_index(Object* object)
+		{
+			auto [iter, inserted] = indices.try_emplace(object, (u32)objects.size());
+			if (inserted)
+			{
+				objects.push_back(object);
+			}
+			return iter->second;
+		}
+
+		void write_value(Writer& writer, const Value& value)
+		{
+			if (is_nil(value))
+			{
+				writer.write(ValueTag::NIL);
+			}
+			else if (is_bool(value))
+			{
+				writer.write(ValueTag::BOOL);
+				writer.write<u8>(as_bool(value) ? 1 : 0);
+			}
+			else if (is_number(value))
+			{
+				writer.write(ValueTag::NUMBER);
+				writer.write<f64>(as_number(value));
+			}
+			else
+			{
+				writer.write(ValueTag::OBJECT);
+				writer.write<u32>(object_index(as_object(value)));
+			}
+		}
+
+		void begin_references(u32 index)
+		{
+			references.write<u32>(index);
+			++reference_count;
+		}
+
+		template<typename TTable>
+		void write_table(const TTable& table)
+		{
+			references.write<u32>((u32)table.size());
+			for (const auto& [name, value] : table)
+			{
+				references.write<u32>(object_index(name));
+				write_value(references, value);
+			}
+		}
+
+		void write_object(Object* object, u32 index)
+		{
+			Writer& creation = creations[(std::size_t)object->type];
+			creation.write(object->type);
+			creation.write<u32>(index);
+
+			switch (object->type)
+			{
+				case ObjectType::STRING:
+				{
+					creation.write_string(static_cast<ObjectString*>(object)->get_string());
+					break;
+				}
+				case ObjectType::FUNCTION:
+				{
+					ObjectFunction* function = static_cast<ObjectFunction*>(object);
+					creation.write<i32>(function->arity);
+					creation.write<i32>(function->upvalue_count);
+					creation.write<i32>(function->max_slots);
+					creation.write<u32>(function->name != nullptr ? object_index(function->name) : NO_OBJECT);
+
+					const Chunk& chunk = function->chunk;
+					creation.write<u32>((u32)chunk.code.size());
+					creation.write_bytes(chunk.code.data(), chunk.code.size());
+					creation.write<u32>((u32)chunk.lines.size());
+					creation.write_bytes(chunk.lines.data(), chunk.lines.size() * sizeof(LineStart));
+
+					begin_references(index);
+					references.write<u32>((u32)chunk.constants.size());
+					for (const Value& constant : chunk.constants)
+					{
+						write_value(references, constant);
+					}
+					break;
+				}
+				case ObjectType::UPVALUE:
+				{
+					// Open upvalues point into the stack of a script that's still running
+					ObjectUpvalue* upvalue = static_cast<ObjectUpvalue*>(object);
+					failed = failed || upvalue->location != &upvalue->closed;
+
+					begin_references(index);
+					write_value(references, upvalue->closed);
+					break;
+				}
+				case ObjectType::CLOSURE:
+				{
+					ObjectClosure* closure = static_cast<ObjectClosure*>(object);
+					creation.write<u32>(object_index(closure->function));
+
+					begin_references(index);
+					references.write<u32>((u32)closure->upvalues.size());
+					for (ObjectUpvalue* upvalue : closure->upvalues)
+					{
+						references.write<u32>(object_index(upvalue));
+					}
+					break;
+				}
+				case ObjectType::NATIVE_FUNCTION:
+				{
+					const char* name = get_native_name(static_cast<ObjectNativeFunction*>(object)->function);
+					failed = failed || name == nullptr;
+					creation.write_string(name != nullptr ? name : "");
+					break;
+				}
+				case ObjectType::CLASS:
+				{
+					ObjectClass* klass = static_cast<ObjectClass*>(object);
+					creation.write<u32>(object_index(klass->name));
+
+					begin_references(index);
+					write_table(klass->methods);
+					break;
+				}
+				case ObjectType::INSTANCE:
+				{
+					ObjectInstance* instance = static_cast<ObjectInstance*>(object);
+					creation.write<u32>(object_index(instance->klass));
+
+					begin_references(index);
+					write_table(instance->fields);
+					break;
+				}
+				case ObjectType::BOUND_METHOD:
+				{
+					ObjectBoundMethod* bound = static_cast<ObjectBoundMethod*>(object);
+					creation.write<u32>(object_index(bound->method));
+
+					begin_references(index);
+					write_value(references, bound->receiver);
+					break;
+				}
+				default:
+				{
+					failed = true;
+					break;
+				}
+			}
+		}
+	};
+
+	struct ImageLoader
+	{
+		Reader reader;
+		std::vector<Object*> objects;
+
+		// Nothing collects garbage while we're loading, so none of these need to be kept alive until the globals reference them
+		Object* find_object(u32 index)
+		{
+			Object* object = index < objects.size() ? objects[index] : nullptr;
+			reader.failed = reader.failed || object == nullptr;
+			return object;
+		}
+
+		template<typename T>
+		T* find_object(u32 index)
+		{
+			T* object = object_cast<T>(find_object(index));
+			reader.failed = reader.failed || object == nullptr;
+			return object;
+		}
+
+		Object* read_object()
+		{
+			return find_object(reader.read<u32>());
+		}
+
+		template<typename T>
+		T* read_object()
+		{
+			return find_object<T>(reader.read<u32>());
+		}
+
+		Value read_value()
+		{
+			switch (reader.read<ValueTag>())
+			{
+				case ValueTag::NIL:
+				{
+					return nullptr;
+				}
+				case ValueTag::BOOL:
+				{
+					return reader.read<u8>() != 0;
+				}
+				case ValueTag::NUMBER:
+				{
+					return reader.read<f64>();
+				}
+				case ValueTag::OBJECT:
+				{
+					Object* object = read_object();
+					return object != nullptr ? Value{object} : Value{nullptr};
+				}
+				default:
+				{
+					reader.failed = true;
+					return nullptr;
+				}
+			}
+		}
+
+		// Everything else an object needs when it's created comes from the image, and was pretenured, but strings that were
+		// interned before the image was loaded may still be young
+		void add_string_reference(Object* holder, ObjectString* string)
+		{
+			HeapWriteLock lock;
+			write_barrier(holder, nullptr, string);
+		}
+
+		Object* create_object(ObjectType type)
+		{
+			switch (type)
+			{
+				case ObjectType::STRING:
+				{
+					std::string_view text = reader.read_string();
+					return reader.failed ? nullptr : ObjectString::allocate(Lox::String{text.data(), text.size()});
+				}
+				case ObjectType::FUNCTION:
+				{
+					i32 arity = reader.read<i32>();
+					i32 upvalue_count = reader.read<i32>();
+					i32 max_slots = reader.read<i32>();
+					u32 name_index = reader.read<u32>();
+					ObjectString* name = name_index != NO_OBJECT ? find_object<ObjectString>(name_index) : nullptr;
+
+					u32 code_size = reader.read<u32>();
+					const u8* code = reader.read_bytes(code_size);
+					u32 line_count = reader.read<u32>();
+					const u8* lines = reader.read_bytes(line_count * sizeof(LineStart));
+
+					// Closures reserve room for all of their upvalues up front, so a damaged count mustn't get that far
+					if (reader.failed || arity < 0 || arity > UINT8_MAX || upvalue_count < 0 || upvalue_count > UINT16_MAX + 1)
+					{
+						return nullptr;
+					}
+
+					ObjectFunction* function = ObjectFunction::allocate();
+					function->arity = arity;
+					function->upvalue_count = upvalue_count;
+					function->max_slots = max_slots;
+					function->name = name;
+					add_string_reference(function, name);
+					function->chunk.code.assign(code, code + code_size);
+
+					// The mapped bytes may not be aligned for LineStart, so copy these out instead of reading them in place
+					if (line_count > 0)
+					{
+						function->chunk.lines.resize(line_count);
+						std::memcpy(function->chunk.lines.data(), lines, line_count * sizeof(LineStart));
+					}
+					return function;
+				}
+				case ObjectType::UPVALUE:
+				{
+					ObjectUpvalue* upvalue = ObjectUpvalue::allocate(nullptr);
+					upvalue->location = &upvalue->closed;
+					return upvalue;
+				}
+				case ObjectType::CLOSURE:
+				{
+					ObjectFunction* function = read_object<ObjectFunction>();
+					return function != nullptr ? ObjectClosure::allocate(function) : nullptr;
+				}
+				case ObjectType::NATIVE_FUNCTION:
+				{
+					NativeFn function = find_native(reader.read_string());
+					return function != nullptr ? ObjectNativeFunction::allocate(function) : nullptr;
+				}
+				case ObjectType::CLASS:
+				{
+					ObjectString* name = read_object<ObjectString>();
+					if (name == nullptr)
+					{
+						return nullptr;
+					}
+
+					ObjectClass* klass = ObjectClass::allocate(name);
+					add_string_reference(klass, name);
+					return klass;
+				}
+				case ObjectType::INSTANCE:
+				{
+					ObjectClass* klass = read_object<ObjectClass>();
+					return klass != nullptr ? ObjectInstance::allocate(klass) : nullptr;
+				}
+				case ObjectType::BOUND_METHOD:
+				{
+					ObjectClosure* method = read_object<ObjectClosure>();
+					return method != nullptr ? ObjectBoundMethod::allocate(nullptr, method) : nullptr;
+				}
+				default:
+				{
+					return nullptr;
+				}
+			}
+		}
+
+		template<typename TTable>
+		void read_table(Object* holder, TTable& table)
+		{
+			// Bounded by what's left of the image, as a damaged count mustn't make us allocate a huge table
+			u32 count = reader.read<u32>();
+			table.reserve(std::min<std::size_t>(count, reader.end - reader.current));
+			for (u32 index = 0; index < count && !reader.failed; ++index)
+			{
+				ObjectString* name = read_object<ObjectString>();
+				Value value = read_value();
+				if (!reader.failed)
+				{
+					Value& slot = table[name];
+					write_barrier(holder, nullptr, name);
+					write_barrier(holder, slot, value);
+					slot = value;
+				}
+			}
+		}
+
+		void fill_references(Object* object)
+		{
+			HeapWriteLock lock;
+
+			switch (object->type)
+			{
+				case ObjectType::FUNCTION:
+				{
+					ObjectFunction* function = static_cast<ObjectFunction*>(object);
+					u32 count = reader.read<u32>();
+					for (u32 index = 0; index < count && !reader.failed; ++index)
+					{
+						Value constant = read_value();
+						write_barrier(function, nullptr, constant);
+						function->chunk.add_constant(constant);
+					}
+					break;
+				}
+				case ObjectType::UPVALUE:
+				{
+					ObjectUpvalue* upvalue = static_cast<ObjectUpvalue*>(object);
+					Value closed = read_value();
+					write_barrier(upvalue, upvalue->closed, closed);
+					upvalue->closed = closed;
+					break;
+				}
+				case ObjectType::CLOSURE:
+				{
+					// The VM takes the number of upvalues from the function, so the two had better agree
+					ObjectClosure* closure = static_cast<ObjectClosure*>(object);
+					u32 count = reader.read<u32>();
+					reader.failed = reader.failed || count != (u32)closure->function->upvalue_count;
+					for (u32 index = 0; index < count && !reader.failed; ++index)
+					{
+						if (ObjectUpvalue* upvalue = read_object<ObjectUpvalue>())
+						{
+							write_barrier(closure, nullptr, upvalue);
+							closure->upvalues.push_back(upvalue);
+						}
+					}
+					break;
+				}
+				case ObjectType::CLASS:
+				{
+					ObjectClass* klass = static_cast<ObjectClass*>(object);
+					read_table(klass, klass->methods);
+					break;
+				}
+				case ObjectType::INSTANCE:
+				{
+					ObjectInstance* instance = static_cast<ObjectInstance*>(object);
+					read_table(instance, instance->fields);
+					break;
+				}
+				case ObjectType::BOUND_METHOD:
+				{
+					ObjectBoundMethod* bound = static_cast<ObjectBoundMethod*>(object);
+					Value receiver = read_value();
+					write_barrier(bound, bound->receiver, receiver);
+					bound->receiver = receiver;
+					break;
+				}
+				default:
+				{
+					reader.failed = true;	 // Strings and natives don't reference other objects
+					break;
+				}
+			}
+		}
+	};
+
+	// Like the bytecode cache, this goes through a temporary file, so that nobody ever maps a half-written image
+	bool write_file(const char* path, const std::vector<u8>& bytes)
+	{
+		std::filesystem::path image_path{path};
+		std::filesystem::path temp_path = get_temporary_path(image_path);
+
+		std::error_code error;
+		{
+			std::ofstream stream{temp_path, std::ios::binary | std::ios::trunc};
+			if (!stream.is_open())
+			{
+				return false;
+			}
+
+			stream.write(reinterpret_cast<const char*>(bytes.data()), (std::streamsize)bytes.size());
+			if (!stream.good())
+			{
+				stream.close();
+				std::filesystem::remove(temp_path, error);
+				return false;
+			}
+		}
+
+		std::filesystem::rename(temp_path, image_path, error);
+		if (error)
+		{
+			std::filesystem::remove(temp_path, error);
+			return false;
+		}
+		return true;
+	}
+}	 // namespace HeapImageImpl
+
+bool Lox::save_heap_image(const char* path)
+{
+	using namespace HeapImageImpl;
+
+	ImageWriter image;
+	for (const auto& [name, value] : vm.globals)
+	{
+		image.globals.write<u32>(image.object_index(name));
+		image.write_value(image.globals, value);
+	}
+
+	// This finds more objects as it goes
+	for (u32 index = 0; index < (u32)image.objects.size() && !image.failed; ++index)
+	{
+		image.write_object(image.objects[index], index);
+	}
+
+	if (image.failed)
+	{
+		return false;
+	}
+
+	Header header;
+	header.object_count = (u32)image.objects.size();
+	header.reference_count = image.reference_count;
+	header.global_count = (u32)vm.globals.size();
+
+	Writer file;
+	file.write(header);
+	for (const Writer& creation : image.creations)
+	{
+		file.write_bytes(creation.bytes.data(), creation.bytes.size());
+	}
+	file.write_bytes(image.references.bytes.data(), image.references.bytes.size());
+	file.write_bytes(image.globals.bytes.data(), image.globals.bytes.size());
+
+	return write_file(path, file.bytes);
+}
+
+bool Lox::load_heap_image(const char* path)
+{
+	using namespace HeapImageImpl;
+
+	MappedFile image_file;
+	if (!image_file.open(path))
+	{
+		return false;
+	}
+
+	ImageLoader image;
+	image.reader.current = image_file.data();
+	image.reader.end = image_file.data() + image_file.size();
+	Reader& reader = image.reader;
+
+	// Every object takes a few bytes at least, which keeps damaged counts from making us allocate huge tables up front
+	Header header = reader.read<Header>();
+	if (reader.failed							   //
+		|| header.magic != IMAGE_MAGIC			   //
+		|| header.version != IMAGE_VERSION		   //
+		|| header.bytecode_version != BYTECODE_VERSION	  //
+		|| header.object_count > image_file.size())
+	{
+		return false;
+	}
+
+	image.objects.resize(header.object_count);
+
+	pretenure_objects = true;
+	for (u32 count = 0; count < header.object_count && !reader.failed; ++count)
+	{
+		ObjectType type = reader.read<ObjectType>();
+		u32 index = reader.read<u32>();
+		if (index >= image.objects.size() || image.objects[index] != nullptr)
+		{
+			reader.failed = true;
+			break;
+		}
+
+		image.objects[index] = image.create_object(type);
+		reader.failed = reader.failed || image.objects[index] == nullptr;
+	}
+
+	pretenure_objects = false;
+
+	for (u32 count = 0; count < header.reference_count && !reader.failed; ++count)
+	{
+		if (Object* object = image.read_object())
+		{
+			image.fill_references(object);
+		}
+	}
+
+	// Like with the bytecode cache, the code of every function has to be something the compiler could have produced.
+	// Closures whose references were missing from the image would have the VM read past the end of their upvalues
+	for (Object* object : image.objects)
+	{
+		const ObjectFunction* function = object_cast<ObjectFunction>(object);
+		const ObjectClosure* closure = object_cast<ObjectClosure>(object);
+		if ((function != nullptr && count_max_slots(function) != function->max_slots)
+			|| (closure != nullptr && closure->upvalues.size() != (std::size_t)closure->function->upvalue_count))
+		{
+			reader.failed = true;
+		}
+	}
+
+	// Only define the globals once we know the image is fine, so that a damaged one doesn't leave the VM half set up
+	std::vector<std::pair<ObjectString*, Value>> globals;
+	for (u32 count = 0; count < header.global_count && !reader.failed; ++count)
+	{
+		ObjectString* name = image.read_object<ObjectString>();
+		Value value = image.read_value();
+		globals.emplace_back(name, value);
+	}
+
+	if (reader.failed || reader.current != reader.end)
+	{
+		return false;
+	}
+
+	HeapWriteLock lock;
+	for (const auto& [name, value] : globals)
+	{
+		Value& global = vm.globals[name];
+		write_barrier_global(name, global, value);
+		global = value;
+	}
+	return true;
+}
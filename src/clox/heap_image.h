@@ -0,0 +1,16 @@
+#pragma once
+
+namespace Lox
+{
+	// A heap image holds the globals of a VM along with everything they reference: Interned strings, compiled functions,
+	// closures and their upvalues, classes, instances and bound methods. Saving one after a prelude script has run lets later
+	// runs start from where it left off, without compiling or running it again.
+	//
+	// Images refer to objects by their index in the image instead of their address, so loading one just maps the file and
+	// builds the objects again in a single pass over it, wherever the heap of the new process puts them.
+	//
+	// Only save images in between scripts, where nothing but the globals is alive. Loading one defines its globals on top of
+	// whatever the VM has already, and fails on images from other versions of clox, or ones that are damaged
+	bool save_heap_image(const char* path);
+	bool load_heap_image(const char* path);
+}	 // namespace Lox
@@ -1,11 +1,20 @@
+#include "alloc_profiler.h"
+#include "bytecode_cache.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "heap_image.h"
+#include "mapped_file.h"
+#include "scanner.h"
 #include "vm.h"
 
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
+#include <format>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 namespace fs = std::filesystem;
 
@@ -23,7 +32,9 @@ namespace Lox
 	};
 }
 
-Lox::String read_file(const char* path)
+// Maps the file straight into memory instead of copying it around, so that the scanner can read
+// the source directly from the mapping. The mapping is guaranteed to be null-terminated
+void read_file(const char* path, Lox::MappedFile& file)
 {
 	fs::path fs_path{path};
 	if (!fs::is_regular_file(fs_path))
@@ -32,45 +43,127 @@ Lox::String read_file(const char* path)
 		exit(Lox::ERROR_CODE_NOINPUT);
 	}
 
-	std::ifstream file_stream{fs_path};
-	if (!file_stream.is_open())
+	if (!file.open(path, true))
 	{
 		std::cerr << "Could not open file '" << fs_path << "'" << std::endl;
 		exit(Lox::ERROR_CODE_IOERR);
 	}
+}
 
-	std::stringstream sstream;
-	sstream << file_stream.rdbuf();
-
-	Lox::String file_contents;
-	file_contents = sstream.str();
+// Set by --heap-census and --alloc-profile, to report on the heap once the script or the REPL is done
+bool print_census_when_done = false;
+const char* alloc_profile_prefix = nullptr;
 
-	file_stream.close();
+void report_on_heap()
+{
+	if (print_census_when_done)
+	{
+		Lox::print_heap_census();
+	}
 
-	return file_contents;
+	if (alloc_profile_prefix != nullptr)
+	{
+		Lox::write_allocation_profile(alloc_profile_prefix);
+	}
 }
 
+// Set by --save-image, to save the globals the script leaves behind for later runs to --image from
+const char* save_image_path = nullptr;
+
 void run_file(const char* path)
 {
-	Lox::String source = read_file(path);
-	Lox::InterpretResult result = Lox::interpret(source.c_str());
+	Lox::MappedFile source_file;
+	read_file(path, source_file);
+
+	const char* source = reinterpret_cast<const char*>(source_file.data());
+	[[maybe_unused]] std::size_t source_length = source_file.size();
 
-	if (result == Lox::InterpretResult::COMPILE_ERROR)
+	Lox::ObjectFunction* function = nullptr;
+#if USE_BYTECODE_CACHE
+	function = Lox::load_bytecode_cache(path, source, source_length);
+#endif
+
+	if (function == nullptr)
 	{
-		exit(Lox::ERROR_CODE_DATAERR);
+		function = Lox::compile(source);
+		if (function == nullptr)
+		{
+			exit(Lox::ERROR_CODE_DATAERR);
+		}
+
+#if USE_BYTECODE_CACHE
+		Lox::save_bytecode_cache(path, source, source_length, function);
+#endif
+	}
+
+	// Nothing references the source text after compilation, as everything we need from it was copied into ObjectStrings
+	source_file.close();
+
+	Lox::InterpretResult result = Lox::interpret(function);
+
+	if (save_image_path != nullptr && result == Lox::InterpretResult::OK && !Lox::save_heap_image(save_image_path))
+	{
+		std::cerr << "Could not write heap image '" << save_image_path << "'" << std::endl;
+		exit(Lox::ERROR_CODE_IOERR);
 	}
 
+	report_on_heap();
+
 	if (result == Lox::InterpretResult::RUNTIME_ERROR)
 	{
 		exit(Lox::ERROR_CODE_SOFTWARE);
 	}
 }
 
+// Scans the whole file over and over without compiling it, and reports the scanner throughput
+void bench_scanner(const char* path)
+{
+	using Clock = std::chrono::steady_clock;
+
+	Lox::MappedFile source_file;
+	read_file(path, source_file);
+	const char* source = reinterpret_cast<const char*>(source_file.data());
+
+	u64 token_count = 0;
+	i32 pass_count = 0;
+	Clock::duration elapsed{};
+
+	// Keep going for at least a second so that small files still give us stable numbers
+	while (pass_count < 3 || elapsed < std::chrono::seconds(1))
+	{
+		Clock::time_point start = Clock::now();
+
+		Lox::init_scanner(source);
+		while (Lox::scan_token().type != Lox::TokenType::EOF_)
+		{
+			token_count++;
+		}
+
+		elapsed += Clock::now() - start;
+		pass_count++;
+	}
+
+	f64 seconds = std::chrono::duration<f64>(elapsed).count();
+	f64 megabytes = (f64)source_file.size() * pass_count / (1024.0 * 1024.0);
+	std::cout << std::format(
+		"Scanned {} bytes into {} tokens, {} passes: {:.1f} MB/s\n",
+		source_file.size(),
+		token_count / pass_count,
+		pass_count,
+		megabytes / seconds
+	);
+}
+
+constexpr f64 REPL_IDLE_GC_BUDGET_US = 10000;
+
 void repl()
 {
 	Lox::String input;
 	while (true)
 	{
+		// Waiting for the user is the perfect time to get on with collecting garbage
+		Lox::collect_garbage_idle(REPL_IDLE_GC_BUDGET_US);
+
 		std::cout << "> ";
 
 		if (!std::getline(std::cin, input))
@@ -78,8 +171,12 @@ void repl()
 			break;
 		}
 
+		// Each line is a request of its own, and whatever it didn't store in a global is garbage once it's done
+		Lox::AllocationRegion region;
 		Lox::interpret(input.c_str());
 	}
+
+	report_on_heap();
 }
 
 int main([[maybe_unused]] int argc, [[maybe_unused]] const char* argv[])
@@ -88,17 +185,84 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] const char* argv[])
 
 	Lox::Chunk c;
 
-	if (argc == 1)
+	// Settings from the command line are applied last, so that they win over the ones from the environment
+	if (const char* settings = std::getenv("CLOX_GC"); settings != nullptr && !Lox::configure_gc(settings))
+	{
+		exit(Lox::ERROR_CODE_USAGE);
+	}
+
+	const char* image_path = nullptr;
+
+	i32 arg_index = 1;
+	for (; arg_index < argc; ++arg_index)
+	{
+		std::string_view option{argv[arg_index]};
+		if (option == "--gc-stats")
+		{
+			// Reported at exit, so that we also get them when the script ends with an error
+			std::atexit(Lox::print_gc_stats);
+		}
+		else if (option == "--heap-census")
+		{
+			print_census_when_done = true;
+		}
+		else if (option.starts_with("--alloc-profile="))
+		{
+			alloc_profile_prefix = argv[arg_index] + option.find('=') + 1;
+			Lox::start_allocation_profiler(ALLOC_PROFILE_SAMPLE_BYTES);
+		}
+		else if (option.starts_with("--heap-snapshot="))
+		{
+			// Snapshots that collections ask for through snapshot_at go there as well
+			Lox::heap_snapshot_prefix = argv[arg_index] + option.find('=') + 1;
+#ifdef SIGUSR1
+			std::signal(SIGUSR1, [](int) { Lox::heap_snapshot_requested = true; });
+#endif
+		}
+		else if (option.starts_with("--image="))
+		{
+			image_path = argv[arg_index] + option.find('=') + 1;
+		}
+		else if (option.starts_with("--save-image="))
+		{
+			save_image_path = argv[arg_index] + option.find('=') + 1;
+		}
+		else if (option.starts_with("--gc="))
+		{
+			if (!Lox::configure_gc(argv[arg_index] + option.find('=') + 1))
+			{
+				exit(Lox::ERROR_CODE_USAGE);
+			}
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	// Loaded once the GC settings are in, as the image fills the heap before anything else runs
+	if (image_path != nullptr && !Lox::load_heap_image(image_path))
+	{
+		std::cerr << "Could not load heap image '" << image_path << "'" << std::endl;
+		exit(Lox::ERROR_CODE_DATAERR);
+	}
+
+	i32 arg_count = argc - arg_index;
+	if (arg_count == 0)
 	{
 		repl();
 	}
-	else if (argc == 2)
+	else if (arg_count == 1)
+	{
+		run_file(argv[arg_index]);
+	}
+	else if (arg_count == 2 && std::string_view{argv[arg_index]} == "--bench-scanner")
 	{
-		run_file(argv[1]);
+		bench_scanner(argv[arg_index + 1]);
 	}
 	else
 	{
-		std::cerr << "Usage: clox [path]" << std::endl;
+		std::cerr << "Usage: clox [--gc-stats] [--heap-census] [--alloc-profile=path] [--heap-snapshot=path] [--image=path] [--save-image=path] [--gc=settings] [--bench-scanner] [path]" << std::endl;
 		exit(Lox::ERROR_CODE_USAGE);
 	}
 
@@ -0,0 +1,191 @@
+#include "mapped_file.h"
+
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+// These clash with our own Op::TRUE, TokenType::FALSE, etc. since everything ends up in a single unity translation unit
+#undef TRUE
+#undef FALSE
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Lox::MappedFile::~MappedFile()
+{
+	close();
+}
+
+namespace MappedFileImpl
+{
+	std::size_t get_page_size()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		return (std::size_t)system_info.dwPageSize;
+#else
+		return (std::size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+}	 // namespace MappedFileImpl
+
+std::filesystem::path Lox::get_temporary_path(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+	u32 process_id = (u32)GetCurrentProcessId();
+#else
+	u32 process_id = (u32)getpid();
+#endif
+
+	std::filesystem::path temp_path = path;
+	temp_path += "." + std::to_string(process_id) + ".tmp";
+	return temp_path;
+}
+
+bool Lox::MappedFile::open(const char* path, bool null_terminated)
+{
+	using namespace MappedFileImpl;
+
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	view_size = (std::size_t)file_size.QuadPart;
+
+	// Windows refuses to map empty files, but there is nothing to read in that case anyway
+	if (view_size > 0)
+	{
+		mapping_handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping_handle == nullptr)
+		{
+			close();
+			return false;
+		}
+
+		view = static_cast<const u8*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+		if (view == nullptr)
+		{
+			close();
+			return false;
+		}
+	}
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	view_size = (std::size_t)file_stat.st_size;
+
+	// mmap refuses zero-length mappings, but there is nothing to read in that case anyway
+	if (view_size > 0)
+	{
+		void* mapping = mmap(nullptr, view_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			::close(fd);
+			view_size = 0;
+			return false;
+		}
+
+		view = static_cast<const u8*>(mapping);
+	}
+
+	// The mapping keeps its own reference to the file, so we don't need the descriptor anymore
+	::close(fd);
+#endif
+
+	if (null_terminated && view_size % get_page_size() == 0)
+	{
+		terminated_copy.reserve(view_size + 1);
+		terminated_copy.assign(view, view + view_size);
+		terminated_copy.push_back('\0');
+
+		std::size_t copied_size = view_size;
+		unmap();
+		view_size = copied_size;
+	}
+
+	opened = true;
+	return true;
+}
+
+void Lox::MappedFile::close()
+{
+	unmap();
+	opened = false;
+
+	terminated_copy.clear();
+	terminated_copy.shrink_to_fit();
+}
+
+void Lox::MappedFile::unmap()
+{
+#ifdef _WIN32
+	if (view != nullptr)
+	{
+		UnmapViewOfFile(view);
+	}
+	if (mapping_handle != nullptr)
+	{
+		CloseHandle(mapping_handle);
+		mapping_handle = nullptr;
+	}
+	if (file_handle != nullptr)
+	{
+		CloseHandle(file_handle);
+		file_handle = nullptr;
+	}
+#else
+	if (view != nullptr)
+	{
+		munmap(const_cast<u8*>(view), view_size);
+	}
+#endif
+
+	view = nullptr;
+	view_size = 0;
+}
+
+bool Lox::MappedFile::is_open() const
+{
+	return opened;
+}
+
+const u8* Lox::MappedFile::data() const
+{
+	return terminated_copy.empty() ? view : terminated_copy.data();
+}
+
+std::size_t Lox::MappedFile::size() const
+{
+	return view_size;
+}
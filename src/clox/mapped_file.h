@@ -0,0 +1,51 @@
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <vector>
+
+namespace Lox
+{
+	// Where to write a file before renaming it over path, so that readers never map it half-written. The name includes
+	// the process id, so that processes writing the same file at once don't write into each other's temporary file
+	std::filesystem::path get_temporary_path(const std::filesystem::path& path);
+
+	// Read-only view of an entire file, mapped into memory by the OS instead of being copied
+	// into our own buffers. The view is released when the MappedFile goes out of scope.
+	//
+	// If null_terminated is requested, data()[size()] is guaranteed to be readable and '\0', so that the
+	// scanner can run directly on the mapping: The OS zero-fills the rest of the last page of a mapping,
+	// so we only need to copy the file into our own buffer when its size is an exact multiple of the page size
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		~MappedFile();
+
+		bool open(const char* path, bool null_terminated = false);
+		void close();
+
+		bool is_open() const;
+		const u8* data() const;
+		std::size_t size() const;
+
+	private:
+		const u8* view = nullptr;
+		std::size_t view_size = 0;
+		bool opened = false;
+
+		void unmap();
+
+		// Only used when we can't rely on the zero-filled tail of the mapping for the null terminator.
+		// This is std::vector and not Lox::Vec as source code shouldn't count against the GC heap
+		std::vector<u8> terminated_copy;
+
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#endif
+	};
+}	 // namespace Lox
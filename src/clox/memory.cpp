@@ -4,214 +4,2753 @@
 #include "object.h"
 #include "vm.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+// These clash with our own Op::TRUE, TokenType::FALSE, etc. since everything ends up in a single unity translation unit
+#undef TRUE
+#undef FALSE
+#else
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace MemoryImpl
 {
 	using namespace Lox;
 
-	void mark_roots()
+	// Both pages and nursery blocks are aligned to their size, and start with a bitmap holding one mark bit for every
+	// CELL_GRANULE bytes in them. This way marking doesn't write to the objects themselves, keeping the cache lines of
+	// live objects clean (and shared with the parent process after a fork), and sweeping works on whole bitmap words.
+	// Objects only need pointer alignment, so with the 8 byte header the smallest ones fit in 16 byte cells
+	constexpr std::size_t CELL_GRANULE = 8;
+
+	template<std::size_t BLOCK_SIZE>
+	using MarkBitmap = std::array<u64, BLOCK_SIZE / CELL_GRANULE / 64>;
+
+	// Objects only ever live in pages and nursery blocks, which we get as chunks aligned to their size from here
+#if USE_COMPRESSED_POINTERS
+	// With USE_COMPRESSED_POINTERS the chunks are carved out of the heap cage. That only reserves address space up front,
+	// the OS backs it with memory as we touch it, and chunks we free are given back to the OS until they're reused
+	constexpr std::size_t CAGE_SIZE = 4ull * 1024 * 1024 * 1024;
+
+	char* cage_top = nullptr;
+	char* cage_end = nullptr;
+	std::unordered_map<std::size_t, std::vector<void*>> free_cage_chunks;
+
+	char* align_up(char* address, std::size_t alignment)
 	{
-		for (i32 stack_slot = 0; stack_slot < vm.stack_position; ++stack_slot)
+		return reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(address) + alignment - 1) & ~(alignment - 1));
+	}
+
+	void reserve_cage()
+	{
+#ifdef _WIN32
+		void* memory = VirtualAlloc(nullptr, CAGE_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+		if (memory == nullptr)
 		{
-			Value* slot = &vm.stack[stack_slot];
-			mark_value(*slot);
+			throw std::bad_alloc();
 		}
+#else
+		void* memory = mmap(nullptr, CAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+#endif
 
-		for (const auto& [str, val] : vm.globals)
+		heap_cage_base = static_cast<char*>(memory);
+		cage_top = heap_cage_base;
+		cage_end = heap_cage_base + CAGE_SIZE;
+	}
+
+	void* allocate_chunk(std::size_t size)
+	{
+		char* chunk = nullptr;
+		std::vector<void*>& free_chunks = free_cage_chunks[size];
+		if (!free_chunks.empty())
 		{
-			mark_object(str);
-			mark_value(val);
+			chunk = static_cast<char*>(free_chunks.back());
+			free_chunks.pop_back();
 		}
+		else
+		{
+			if (heap_cage_base == nullptr)
+			{
+				reserve_cage();
+			}
 
-		for (i32 frame_index = 0; frame_index < vm.frames_position; ++frame_index)
+			// Running out of cage is running out of memory, the heap limit is the way to have scripts fail gracefully before that
+			chunk = align_up(cage_top, size);
+			if (size > (std::size_t)(cage_end - chunk))
+			{
+				throw std::bad_alloc();
+			}
+			cage_top = chunk + size;
+		}
+
+#ifdef _WIN32
+		if (VirtualAlloc(chunk, size, MEM_COMMIT, PAGE_READWRITE) == nullptr)
 		{
-			mark_object(vm.frames[frame_index].closure);
+			free_chunks.push_back(chunk);
+			throw std::bad_alloc();
 		}
+#endif
+		return chunk;
+	}
 
-		for (ObjectUpvalue* upvalue = vm.open_upvalues; upvalue != nullptr; upvalue = upvalue->next_upvalue)
+	void free_chunk(void* chunk, std::size_t size)
+	{
+#ifdef _WIN32
+		VirtualFree(chunk, size, MEM_DECOMMIT);
+#elif defined(__linux__)
+		madvise(chunk, size, MADV_DONTNEED);
+#endif
+		free_cage_chunks[size].push_back(chunk);
+	}
+#else
+	void* allocate_chunk(std::size_t size)
+	{
+		return ::operator new(size, std::align_val_t{size});
+	}
+
+	void free_chunk(void* chunk, std::size_t size)
+	{
+		::operator delete(chunk, std::align_val_t{size});
+	}
+#endif
+
+	// The nursery is made of fixed size blocks that we bump allocate from. If it fills up before the VM reaches
+	// a safepoint we just keep adding blocks, and give the extra ones back after the next minor collection
+	constexpr std::size_t NURSERY_BLOCK_SIZE = 32 * 1024;
+	constexpr std::size_t NURSERY_BLOCK_COUNT = GC_NURSERY_SIZE / NURSERY_BLOCK_SIZE;
+
+	static_assert(alignof(ObjectString) <= CELL_GRANULE && alignof(ObjectFunction) <= CELL_GRANULE && alignof(ObjectClosure) <= CELL_GRANULE
+					  && alignof(ObjectClass) <= CELL_GRANULE && alignof(ObjectInstance) <= CELL_GRANULE,
+				  "Objects must start on a mark bit of their own");
+
+	struct NurseryBlock
+	{
+		MarkBitmap<NURSERY_BLOCK_SIZE> marks{};
+	};
+
+	constexpr std::size_t NURSERY_HEADER_SIZE = (sizeof(NurseryBlock) + CELL_GRANULE - 1) & ~(CELL_GRANULE - 1);
+
+	struct Nursery
+	{
+		std::vector<NurseryBlock*> blocks;
+		std::size_t blocks_used = 0;
+		u8* top = nullptr;
+		u8* end = nullptr;
+	};
+
+	Nursery nursery;
+
+	// How many blocks the nursery may fill before it needs a minor collection, which AllocationRegion raises
+	std::size_t nursery_block_limit = NURSERY_BLOCK_COUNT;
+	i32 region_depth = 0;
+
+	NurseryBlock* allocate_nursery_block()
+	{
+		// The blocks a region grows the nursery by are emptied by the minor collection that ends it, not by a full one
+		if (region_depth == 0)
 		{
-			mark_object(upvalue);
+			request_gc(NURSERY_BLOCK_SIZE);
 		}
 
-		mark_compiler_roots();
-		mark_object(vm.init_string);
+		void* memory = allocate_chunk(NURSERY_BLOCK_SIZE);
+		total_heap_bytes += NURSERY_BLOCK_SIZE;
+		allocated_bytes += NURSERY_BLOCK_SIZE;
+		return new (memory) NurseryBlock{};
 	}
 
-	void blacken_object(Object* object)
+	void free_nursery_block(NurseryBlock* block)
 	{
-#if DEBUG_LOG_GC
-		std::cout << std::format("{} blacken {}", (void*)object, Lox::to_string(object)) << std::endl;
+		block->~NurseryBlock();
+		free_chunk(block, NURSERY_BLOCK_SIZE);
+		total_heap_bytes -= NURSERY_BLOCK_SIZE;
+	}
+
+	// Promoted objects whose references still need forwarding. This can't share vm.gray_stack, as a minor
+	// collection may run while an incremental cycle still has gray objects waiting on it
+	std::vector<Object*> promoted_objects;
+
+	void reset_nursery()
+	{
+		while (nursery.blocks.size() > nursery_block_limit)
+		{
+			free_nursery_block(nursery.blocks.back());
+			nursery.blocks.pop_back();
+		}
+
+		nursery.blocks_used = 0;
+		nursery.top = nullptr;
+		nursery.end = nullptr;
+	}
+
+	// Inside a region, the nursery grows instead of being collected, but only into what the heap limit has room for
+	bool nursery_can_grow()
+	{
+		if (nursery.blocks_used >= nursery_block_limit)
+		{
+			return false;
+		}
+
+		bool needs_new_block = nursery.blocks_used == nursery.blocks.size() && nursery.blocks_used >= NURSERY_BLOCK_COUNT;
+		return !needs_new_block || gc_policy.heap_limit_bytes == 0 || total_heap_bytes + NURSERY_BLOCK_SIZE <= gc_policy.heap_limit_bytes;
+	}
+
+	// Frees the empty blocks a region grew the nursery by, which still count against the heap limit
+	void release_spare_nursery_blocks()
+	{
+		while (nursery.blocks.size() > std::max(nursery.blocks_used, NURSERY_BLOCK_COUNT))
+		{
+			free_nursery_block(nursery.blocks.back());
+			nursery.blocks.pop_back();
+		}
+	}
+
+	// Old objects are allocated from pages that each hold cells of a single size class, so that sweeping can walk through the
+	// pages instead of following a list threaded through every object. Which cells hold objects is tracked by another bitmap
+	// next to the marks, and free cells are linked together through their first bytes
+	constexpr std::size_t PAGE_SIZE = GC_PAGE_SIZE;
+	constexpr std::size_t MAX_CELL_SIZE = 256;
+	constexpr std::size_t SIZE_CLASS_COUNT = MAX_CELL_SIZE / CELL_GRANULE;
+	constexpr std::size_t PAGE_BITMAP_WORDS = PAGE_SIZE / CELL_GRANULE / 64;
+
+#if USE_HUGE_PAGES
+	static_assert(PAGE_SIZE % (2 * 1024 * 1024) == 0, "Huge pages need GC_PAGE_SIZE to be a multiple of 2MB");
 #endif
 
-		if (ObjectUpvalue* upvalue = dynamic_cast<ObjectUpvalue*>(object))
+	struct Page
+	{
+		MarkBitmap<PAGE_SIZE> marks{};
+		u32 size_class = 0;
+		u32 cell_size = 0;
+		u32 cell_count = 0;
+		u32 cells_used = 0;	   // Cells from here on were never handed out, and aren't on the free list either
+		bool is_swept = true;	 // Whether the sweep of the current cycle is done with this page
+		bool is_retiring = false;	 // About to be released, as it's empty or a compaction is moving every object out of it
+		MarkBitmap<PAGE_SIZE> allocated{};
+	};
+
+	constexpr std::size_t PAGE_HEADER_SIZE = (sizeof(Page) + CELL_GRANULE - 1) & ~(CELL_GRANULE - 1);
+
+	struct SizeClass
+	{
+		void* free_cells = nullptr;
+		Page* bump_page = nullptr;
+		std::vector<Page*> unswept_pages;	 // May still hold pages that incremental steps swept in the meantime
+	};
+
+	std::vector<Page*> pages;
+	std::array<SizeClass, SIZE_CLASS_COUNT> size_classes;
+
+	// Pages we gave back to the OS, but kept the address range of, so that the next allocate_page() can simply reuse one
+	std::vector<void*> released_pages;
+
+	Page* page_of(const void* cell)
+	{
+		return reinterpret_cast<Page*>(reinterpret_cast<std::uintptr_t>(cell) & ~(PAGE_SIZE - 1));
+	}
+
+	u8* cell_at(Page* page, std::size_t index)
+	{
+		return reinterpret_cast<u8*>(page) + PAGE_HEADER_SIZE + index * page->cell_size;
+	}
+
+	// Both bitmaps are indexed by granule instead of cell, so that they line up for any size class
+	std::size_t granule_index(const void* block, const void* address)
+	{
+		return (std::size_t)(static_cast<const u8*>(address) - static_cast<const u8*>(block)) / CELL_GRANULE;
+	}
+
+	Object* granule_object(Page* page, std::size_t granule)
+	{
+		return reinterpret_cast<Object*>(reinterpret_cast<u8*>(page) + granule * CELL_GRANULE);
+	}
+
+	// Returns the bitmap word holding the mark of the object, along with its bit in there
+	u64& mark_word(const Object* object, u64& bit)
+	{
+		if (object->is_young)
 		{
-			mark_value(upvalue->closed);
+			auto* block = reinterpret_cast<NurseryBlock*>(reinterpret_cast<std::uintptr_t>(object) & ~(NURSERY_BLOCK_SIZE - 1));
+			std::size_t granule = granule_index(block, object);
+			bit = 1ull << (granule % 64);
+			return block->marks[granule / 64];
 		}
-		else if (ObjectFunction* function = dynamic_cast<ObjectFunction*>(object))
+
+		Page* page = page_of(object);
+		std::size_t granule = granule_index(page, object);
+		bit = 1ull << (granule % 64);
+		return page->marks[granule / 64];
+	}
+
+	bool is_marked(const Object* object)
+	{
+		u64 bit;
+		return (mark_word(object, bit) & bit) != 0;
+	}
+
+	// Returns whether the object was marked already
+	bool set_marked(const Object* object)
+	{
+		u64 bit;
+		u64& word = mark_word(object, bit);
+		bool was_marked = (word & bit) != 0;
+		word |= bit;
+		return was_marked;
+	}
+
+	void* next_free_cell(void* cell)
+	{
+		void* next;
+		std::memcpy(&next, cell, sizeof(void*));
+		return next;
+	}
+
+	void set_next_free_cell(void* cell, void* next)
+	{
+		std::memcpy(cell, &next, sizeof(void*));
+	}
+
+	Page* allocate_page(std::size_t size_class)
+	{
+		void* memory = nullptr;
+		if (!released_pages.empty())
 		{
-			mark_object(function->name);
-			for (const Value& val : function->chunk.constants)
-			{
-				mark_value(val);
-			}
+			memory = released_pages.back();
+			released_pages.pop_back();
 		}
-		else if (ObjectClosure* closure = dynamic_cast<ObjectClosure*>(object))
+		else
 		{
-			mark_object(closure->function);
-			for (ObjectUpvalue* closure_upvalue : closure->upvalues)
-			{
-				mark_object(closure_upvalue);
-			}
+			memory = allocate_chunk(PAGE_SIZE);
+#if USE_HUGE_PAGES && defined(__linux__)
+			// Only a hint, the kernel backs the page with a huge one if it can spare it
+			madvise(memory, PAGE_SIZE, MADV_HUGEPAGE);
+#endif
 		}
-		else if (ObjectClass* klass = dynamic_cast<ObjectClass*>(object))
+
+		Page* page = new (memory) Page{};
+		page->size_class = (u32)size_class;
+		page->cell_size = (u32)((size_class + 1) * CELL_GRANULE);
+		page->cell_count = (u32)((PAGE_SIZE - PAGE_HEADER_SIZE) / page->cell_size);
+		pages.push_back(page);
+		return page;
+	}
+
+	void free_page(Page* page)
+	{
+		page->~Page();
+		free_chunk(page, PAGE_SIZE);
+	}
+
+	// The allocator we get pages from rarely gives memory back to the OS by itself, as freeing a block in the middle of its
+	// heap can't shrink it. So we hold on to the page, and just tell the OS it can drop the physical memory behind it
+	void release_page(Page* page)
+	{
+		page->~Page();
+#ifdef __linux__
+		madvise(page, PAGE_SIZE, MADV_DONTNEED);
+#endif
+		released_pages.push_back(page);
+	}
+
+	template<typename Function>
+	void for_each_object(Page* page, Function function)
+	{
+		for (std::size_t word = 0; word < PAGE_BITMAP_WORDS; ++word)
 		{
-			mark_object(klass->name);
-			for (const auto& [str, val] : klass->methods)
+			u64 bits = page->allocated[word];
+			while (bits != 0)
 			{
-				mark_object(str);
-				mark_value(val);
+				std::size_t granule = word * 64 + (std::size_t)std::countr_zero(bits);
+				bits &= bits - 1;
+
+				function(granule_object(page, granule));
 			}
 		}
-		else if (ObjectInstance* instance = dynamic_cast<ObjectInstance*>(object))
+	}
+
+	// Cells freed by sweeping, which are only handed back to the size classes once the sweep is done.
+	// This way parallel sweeping doesn't need to synchronize on the free lists
+	struct SweptCells
+	{
+		std::array<void*, SIZE_CLASS_COUNT> heads{};
+		std::array<void*, SIZE_CLASS_COUNT> tails{};
+	};
+
+	// Destroys the unmarked objects of the page, and clears the marks of the others
+	void sweep_page(Page* page, SweptCells& swept)
+	{
+		void*& head = swept.heads[page->size_class];
+		void*& tail = swept.tails[page->size_class];
+
+		for (std::size_t word = 0; word < PAGE_BITMAP_WORDS; ++word)
 		{
-			mark_object(instance->klass);
-			for (const auto& [str, val] : instance->fields)
+			u64 unreached = page->allocated[word] & ~page->marks[word];
+			if (unreached == 0)
+			{
+				continue;
+			}
+
+			page->allocated[word] &= page->marks[word];
+
+			while (unreached != 0)
 			{
-				mark_object(str);
-				mark_value(val);
+				std::size_t granule = word * 64 + (std::size_t)std::countr_zero(unreached);
+				unreached &= unreached - 1;
+
+				Object* object = granule_object(page, granule);
+				object->destroy();
+
+				set_next_free_cell(object, head);
+				if (head == nullptr)
+				{
+					tail = object;
+				}
+				head = object;
 			}
 		}
-		else if (ObjectBoundMethod* bound = dynamic_cast<ObjectBoundMethod*>(object))
+
+		page->marks = {};
+		page->is_swept = true;
+	}
+
+	void reuse_swept_cells(SweptCells& swept)
+	{
+		for (std::size_t size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class)
 		{
-			mark_value(bound->receiver);
-			mark_object(bound->method);
+			if (swept.heads[size_class] != nullptr)
+			{
+				set_next_free_cell(swept.tails[size_class], size_classes[size_class].free_cells);
+				size_classes[size_class].free_cells = swept.heads[size_class];
+			}
 		}
+
+		swept = SweptCells{};
 	}
 
-	void trace_references()
+	// Compaction moves the objects of pages that are less than GC_COMPACT_THRESHOLD percent full into other pages of their
+	// size class, but only in size classes where the emptied pages outnumber the new ones the moved objects may need. Every
+	// reference to the moved objects has to be updated by walking the whole heap, so it also has to free a good share of it
+	constexpr std::size_t COMPACT_MIN_FREED_SHARE = 8;	  // As in an eighth of the pages
+
+	// Unmarked objects in pages that are still waiting to be swept are garbage already
+	std::size_t count_live_cells(const Page* page)
 	{
-		while (vm.gray_stack.size() > 0)
+		std::size_t count = 0;
+		for (std::size_t word = 0; word < PAGE_BITMAP_WORDS; ++word)
 		{
-			Object* object = vm.gray_stack.back();
-			vm.gray_stack.pop_back();
-
-			blacken_object(object);
+			count += (std::size_t)std::popcount(page->is_swept ? page->allocated[word] : page->allocated[word] & page->marks[word]);
 		}
+		return count;
 	}
 
-	// Clean object strings from hash tables by properly removing them, before
-	// the generic sweep() just frees the objects themselves
-	template<typename T>
-	void remove_unreferenced_strings(std::unordered_map<T, Lox::ObjectString*>& map)
+	std::vector<Page*> select_evacuation_pages()
 	{
-		for (auto iter = map.cbegin(); iter != map.end();)
+		struct Candidates
 		{
-			const Lox::ObjectString* s = iter->second;
-			if (s != nullptr && !s->is_marked)
+			std::vector<Page*> pages;
+			std::size_t live_cells = 0;
+			std::size_t free_cells = 0;	   // Room for the moved objects in the pages that stay
+			std::size_t cell_count = 0;
+		};
+
+		std::array<Candidates, SIZE_CLASS_COUNT> candidates;
+		for (Page* page : pages)
+		{
+			Candidates& size_class = candidates[page->size_class];
+			size_class.cell_count = page->cell_count;
+
+			// Empty pages are left for release_empty_pages()
+			std::size_t live_cells = count_live_cells(page);
+			if (live_cells == 0)
 			{
-				iter = map.erase(iter);
+				continue;
+			}
+
+			if (page != size_classes[page->size_class].bump_page && live_cells * 100 < page->cell_count * GC_COMPACT_THRESHOLD)
+			{
+				size_class.pages.push_back(page);
+				size_class.live_cells += live_cells;
 			}
 			else
 			{
-				++iter;
+				size_class.free_cells += page->cell_count - live_cells;
+			}
+		}
+
+		std::vector<Page*> selected;
+		std::size_t freed_pages = 0;
+		for (const Candidates& size_class : candidates)
+		{
+			std::size_t overflow = size_class.live_cells > size_class.free_cells ? size_class.live_cells - size_class.free_cells : 0;
+			std::size_t new_pages = size_class.cell_count > 0 ? (overflow + size_class.cell_count - 1) / size_class.cell_count : 0;
+			if (new_pages < size_class.pages.size())
+			{
+				selected.insert(selected.end(), size_class.pages.begin(), size_class.pages.end());
+				freed_pages += size_class.pages.size() - new_pages;
 			}
 		}
+
+		if (freed_pages * COMPACT_MIN_FREED_SHARE < pages.size())
+		{
+			selected.clear();
+		}
+
+		return selected;
 	}
 
-	void sweep()
+	// Rebuilds the free lists of the size classes that lose pages, so that they only hand out cells of the pages that stay
+	void reset_free_cells(const std::vector<Page*>& retiring)
 	{
-		Object* previous = nullptr;
-		Object* object = vm.objects;
-		while (object != nullptr)
+		std::array<bool, SIZE_CLASS_COUNT> is_affected{};
+		for (Page* page : retiring)
 		{
-			if (object->is_marked)
+			is_affected[page->size_class] = true;
+			if (size_classes[page->size_class].bump_page == page)
 			{
-				object->is_marked = false;
+				size_classes[page->size_class].bump_page = nullptr;
+			}
+		}
 
-				previous = object;
-				object = object->next;
+		for (std::size_t index = 0; index < SIZE_CLASS_COUNT; ++index)
+		{
+			if (is_affected[index])
+			{
+				size_classes[index].free_cells = nullptr;
 			}
-			else
+		}
+
+		for (Page* page : pages)
+		{
+			if (!is_affected[page->size_class] || page->is_retiring)
 			{
-				Object* unreached = object;
+				continue;
+			}
 
-				// Reconnect previous to next
-				object = object->next;
-				if (previous != nullptr)
-				{
-					previous->next = object;
-				}
-				else
+			// Going backwards leaves the lowest addresses at the front of the list
+			void*& free_cells = size_classes[page->size_class].free_cells;
+			for (std::size_t index = page->cells_used; index-- > 0;)
+			{
+				u8* cell = cell_at(page, index);
+				std::size_t granule = granule_index(page, cell);
+				if ((page->allocated[granule / 64] & (1ull << (granule % 64))) == 0)
 				{
-					vm.objects = object;
+					set_next_free_cell(cell, free_cells);
+					free_cells = cell;
 				}
-
-				unreached->free();
 			}
 		}
 	}
-}	 // namespace MemoryImpl
 
-void Lox::mark_object(Object* object)
-{
-	if (object == nullptr || object->is_marked)
+	// Once everything is swept, pages without any objects left in them are released, apart from the first few of them
+	// (gc_policy.retained_empty_pages). Those are kept around for the program to fill up again, so that a heap that
+	// merely breathes doesn't keep going back and forth with the OS
+	void release_empty_pages()
 	{
-		return;
-	}
+		std::vector<Page*> released;
+		std::size_t retained = 0;
+		for (Page* page : pages)
+		{
+			if (count_live_cells(page) > 0)
+			{
+				continue;
+			}
 
-#if DEBUG_LOG_GC
-	std::cout << std::format("{} mark {}", (void*)object, Lox::to_string(object)) << std::endl;
-#endif
+			if (retained < gc_policy.retained_empty_pages)
+			{
+				++retained;
+				continue;
+			}
 
-	object->is_marked = true;
+			page->is_retiring = true;
+			released.push_back(page);
+		}
 
-	vm.gray_stack.push_back(object);
-}
+		if (released.empty())
+		{
+			return;
+		}
 
-void Lox::mark_value(Value value)
-{
-	if (is_object(value))
-	{
-		Object* object = as_object(value);
-		mark_object(object);
-	}
-}
+		reset_free_cells(released);
+		std::erase_if(pages, [](const Page* page) { return page->is_retiring; });
+		for (Page* page : released)
+		{
+			release_page(page);
+		}
 
-void Lox::collect_garbage()
-{
-	using namespace MemoryImpl;
+#ifdef __GLIBC__
+		// The garbage we just swept also gave back lots of smaller blocks from containers, which glibc keeps to itself otherwise
+		malloc_trim(0);
+#endif
 
 #if DEBUG_LOG_GC
-	std::cout << "-- gc begin\n";
-	std::size_t before = total_heap_bytes;
+		std::cout << std::format("-- released {} empty pages, {} left\n", released.size(), pages.size());
 #endif
+	}
 
-	mark_roots();
-	trace_references();
-	remove_unreferenced_strings(vm.strings);
-	sweep();
+	// Returns where an object lives after the current minor collection or compaction, promoting it if it's young and we
+	// didn't yet
+	Object* forward(Object* object)
+	{
+		if (object == nullptr)
+		{
+			return object;
+		}
 
-	next_gc = total_heap_bytes * GC_HEAP_GROW_FACTOR;
+		// Moved objects are replaced by an ObjectForwarded, which we may be looking at here
+		object = std::launder(object);
+		if (object->type == ObjectType::FORWARDED)
+		{
+			return static_cast<ObjectForwarded*>(object)->destination;
+		}
 
-#if DEBUG_LOG_GC
-	std::cout << "-- gc end\n";
-	std::cout << std::format("   collected {} bytes (from {} to {}), next at {}\n", before - total_heap_bytes, before, total_heap_bytes, next_gc);
-#endif
-}
+		if (!object->is_young)
+		{
+			return object;
+		}
 
-void Lox::free_objects()
-{
-	using namespace MemoryImpl;
+		// The promoted object may itself point at other young objects, so it goes on the worklist
+		// to have its references forwarded as well, like Cheney's algorithm does with its scan pointer
+		Object* promoted = object->promote();
+		promoted_objects.push_back(promoted);
+		return promoted;
+	}
+
+	bool is_moving(const Object* object)
+	{
+		object = std::launder(object);
+		return object->is_young || object->type == ObjectType::FORWARDED;
+	}
 
-	Object* object = vm.objects;
-	while (object != nullptr)
+	template<typename T>
+	void forward_reference(T*& reference)
 	{
-		Object* next = object->next;
+		reference = static_cast<T*>(forward(reference));
+	}
 
-		object->free();
-		object = next;
+#if USE_COMPRESSED_POINTERS
+	template<typename T>
+	void forward_reference(ObjectRef<T>& reference)
+	{
+		reference = static_cast<T*>(forward(reference));
 	}
+#endif
+
+	void forward_value(Value& value)
+	{
+		if (is_object(value))
+		{
+			value = forward(as_object(value));
+		}
+	}
+
+	template<typename TTable>
+	void forward_table(TTable& table)
+	{
+		bool has_moving_keys = false;
+		for (auto& [key, value] : table)
+		{
+			forward_value(value);
+			has_moving_keys = has_moving_keys || is_moving(key);
+		}
+
+		// Keys are hashed by address, so the table needs rebuilding when any of them moves
+		if (has_moving_keys)
+		{
+			TTable forwarded;
+			forwarded.reserve(table.size());
+			for (const auto& [key, value] : table)
+			{
+				forwarded.emplace(static_cast<ObjectString*>(forward(key)), value);
+			}
+			table = std::move(forwarded);
+		}
+	}
+
+	// Minor collection counterpart to blacken_object()
+	void forward_references(Object* object)
+	{
+		switch (object->type)
+		{
+			case ObjectType::UPVALUE:
+			{
+				forward_value(static_cast<ObjectUpvalue*>(object)->closed);
+				break;
+			}
+			case ObjectType::FUNCTION:
+			{
+				ObjectFunction* function = static_cast<ObjectFunction*>(object);
+				forward_reference(function->name);
+				for (Value& val : function->chunk.constants)
+				{
+					forward_value(val);
+				}
+				break;
+			}
+			case ObjectType::CLOSURE:
+			{
+				ObjectClosure* closure = static_cast<ObjectClosure*>(object);
+				forward_reference(closure->function);
+				for (ObjectRef<ObjectUpvalue>& closure_upvalue : closure->upvalues)
+				{
+					forward_reference(closure_upvalue);
+				}
+				break;
+			}
+			case ObjectType::CLASS:
+			{
+				ObjectClass* klass = static_cast<ObjectClass*>(object);
+				forward_reference(klass->name);
+				forward_table(klass->methods);
+				break;
+			}
+			case ObjectType::INSTANCE:
+			{
+				ObjectInstance* instance = static_cast<ObjectInstance*>(object);
+				forward_reference(instance->klass);
+				forward_table(instance->fields);
+				break;
+			}
+			case ObjectType::BOUND_METHOD:
+			{
+				ObjectBoundMethod* bound = static_cast<ObjectBoundMethod*>(object);
+				forward_value(bound->receiver);
+				forward_reference(bound->method);
+				break;
+			}
+			default:
+			{
+				break;	  // Strings and natives don't reference other objects
+			}
+		}
+	}
+
+	void forward_roots()
+	{
+		// The compiler and the bytecode cache never hold on to objects while the VM is at a safepoint,
+		// so unlike mark_roots() we only need to look at the VM itself
+		for (i32 stack_slot = 0; stack_slot < vm.stack_position; ++stack_slot)
+		{
+			forward_value(vm.stack[stack_slot]);
+		}
+
+		for (i32 frame_index = 0; frame_index < vm.frames_position; ++frame_index)
+		{
+			forward_reference(vm.frames[frame_index].closure);
+		}
+
+		forward_reference(vm.open_upvalues);
+		for (ObjectUpvalue* upvalue = vm.open_upvalues; upvalue != nullptr; upvalue = upvalue->next_upvalue)
+		{
+			forward_reference(upvalue->next_upvalue);
+		}
+
+		forward_reference(vm.init_string);
+	}
+
+	void forward_remembered()
+	{
+		for (ObjectString* name : vm.remembered_globals)
+		{
+			name->is_remembered = false;
+
+			auto iter = vm.globals.find(name);
+			if (iter == vm.globals.end())
+			{
+				continue;	 // Already moved over to the promoted name, if this was a duplicate entry
+			}
+
+			forward_value(iter->second);
+			if (name->is_young)
+			{
+				Value value = iter->second;
+				vm.globals.erase(iter);
+				vm.globals[static_cast<ObjectString*>(forward(name))] = value;
+			}
+		}
+
+		for (Object* object : vm.remembered_objects)
+		{
+			object->is_remembered = false;
+			forward_references(object);
+		}
+
+		vm.remembered_globals.clear();
+		vm.remembered_objects.clear();
+	}
+
+	// One reference from a root or an object to another object. Marking ignores everything but the target, but heap
+	// snapshots describe each reference by these as well
+	struct Reference
+	{
+		const char* kind;
+		const ObjectString* name = nullptr;	   // Global, method or field the reference is stored under
+		i32 index = -1;	   // Stack slot, frame, open upvalue, constant or closure upvalue
+	};
+
+	// Calls visitor.object() or visitor.value() for every root the VM holds. The roots of the compiler aren't part of this,
+	// as only marking needs them: Anything else happens while the VM runs
+	template<typename TVisitor>
+	void for_each_root(TVisitor& visitor)
+	{
+		for (i32 stack_slot = 0; stack_slot < vm.stack_position; ++stack_slot)
+		{
+			visitor.value(vm.stack[stack_slot], Reference{"stack", nullptr, stack_slot});
+		}
+
+		for (const auto& [str, val] : vm.globals)
+		{
+			visitor.object(str, Reference{"global name", str});
+			visitor.value(val, Reference{"global", str});
+		}
+
+		for (i32 frame_index = 0; frame_index < vm.frames_position; ++frame_index)
+		{
+			visitor.object(vm.frames[frame_index].closure, Reference{"frame", nullptr, frame_index});
+		}
+
+		i32 upvalue_index = 0;
+		for (ObjectUpvalue* upvalue = vm.open_upvalues; upvalue != nullptr; upvalue = upvalue->next_upvalue)
+		{
+			visitor.object(upvalue, Reference{"open upvalue", nullptr, upvalue_index++});
+		}
+
+		visitor.object(vm.init_string, Reference{"init string"});
+	}
+
+	// Calls visitor.object() or visitor.value() for every reference the object holds
+	template<typename TVisitor>
+	void for_each_reference(Object* object, TVisitor& visitor)
+	{
+		switch (object->type)
+		{
+			case ObjectType::UPVALUE:
+			{
+				visitor.value(static_cast<ObjectUpvalue*>(object)->closed, Reference{"closed"});
+				break;
+			}
+			case ObjectType::FUNCTION:
+			{
+				ObjectFunction* function = static_cast<ObjectFunction*>(object);
+				visitor.object(function->name, Reference{"name"});
+				for (i32 index = 0; index < (i32)function->chunk.constants.size(); ++index)
+				{
+					visitor.value(function->chunk.constants[index], Reference{"constant", nullptr, index});
+				}
+				break;
+			}
+			case ObjectType::CLOSURE:
+			{
+				ObjectClosure* closure = static_cast<ObjectClosure*>(object);
+				visitor.object(closure->function, Reference{"function"});
+				for (i32 index = 0; index < (i32)closure->upvalues.size(); ++index)
+				{
+					visitor.object(closure->upvalues[index], Reference{"upvalue", nullptr, index});
+				}
+				break;
+			}
+			case ObjectType::CLASS:
+			{
+				ObjectClass* klass = static_cast<ObjectClass*>(object);
+				visitor.object(klass->name, Reference{"name"});
+				for (const auto& [str, val] : klass->methods)
+				{
+					visitor.object(str, Reference{"method name", str});
+					visitor.value(val, Reference{"method", str});
+				}
+				break;
+			}
+			case ObjectType::INSTANCE:
+			{
+				ObjectInstance* instance = static_cast<ObjectInstance*>(object);
+				visitor.object(instance->klass, Reference{"class"});
+				for (const auto& [str, val] : instance->fields)
+				{
+					visitor.object(str, Reference{"field name", str});
+					visitor.value(val, Reference{"field", str});
+				}
+				break;
+			}
+			case ObjectType::BOUND_METHOD:
+			{
+				ObjectBoundMethod* bound = static_cast<ObjectBoundMethod*>(object);
+				visitor.value(bound->receiver, Reference{"receiver"});
+				visitor.object(bound->method, Reference{"method"});
+				break;
+			}
+			default:
+			{
+				break;	  // Strings and natives don't reference other objects
+			}
+		}
+	}
+
+	struct MarkingVisitor
+	{
+		void object(Object* object, const Reference&)
+		{
+			mark_object(object);
+		}
+
+		void value(const Value& value, const Reference&)
+		{
+			mark_value(value);
+		}
+	};
+
+	void mark_roots()
+	{
+		MarkingVisitor visitor;
+		for_each_root(visitor);
+
+		mark_compiler_roots();
+	}
+
+	void blacken_object(Object* object)
+	{
+		// to_string() allocates, which the marker threads of USE_CONCURRENT_GC and USE_PARALLEL_GC must never do
+#if DEBUG_LOG_GC && !USE_CONCURRENT_GC && !USE_PARALLEL_GC
+		std::cout << std::format("{} blacken {}", (void*)object, Lox::to_string(object)) << std::endl;
+#endif
+
+		MarkingVisitor visitor;
+		for_each_reference(object, visitor);
+	}
+
+	void trace_references()
+	{
+		while (vm.gray_stack.size() > 0)
+		{
+			Object* object = vm.gray_stack.back();
+			vm.gray_stack.pop_back();
+
+			blacken_object(object);
+		}
+	}
+
+	// Clean object strings from hash tables by properly removing them, before
+	// the generic sweep() just frees the objects themselves
+	template<typename TTable>
+	void remove_unreferenced_strings(TTable& map)
+	{
+		for (auto iter = map.cbegin(); iter != map.end();)
+		{
+			// Incremental cycles don't mark young strings, those are left for the next minor collection to deal with
+			const Lox::ObjectString* s = iter->second;
+			if (s != nullptr && !(gc_marking && s->is_young) && !is_marked(s))
+			{
+				iter = map.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+	}
+
+	void sweep()
+	{
+		SweptCells swept;
+		for (Page* page : pages)
+		{
+			if (!page->is_swept)
+			{
+				sweep_page(page, swept);
+			}
+		}
+		reuse_swept_cells(swept);
+	}
+
+	// With USE_PARALLEL_GC, full collections are shared out between several worker threads. Each worker marks from its
+	// own stack of gray objects, and hands some of them over to be stolen by idle workers whenever it has plenty left
+	constexpr std::size_t STEAL_BATCH_SIZE = 64;
+
+	struct GcWorker
+	{
+		std::vector<Object*> gray_objects;
+
+		std::mutex shared_mutex;
+		std::vector<Object*> shared_objects;
+		std::atomic<std::size_t> shared_count = 0;
+
+		SweptCells swept;
+	};
+
+	thread_local GcWorker* current_worker = nullptr;
+	std::atomic<std::size_t> idle_workers = 0;
+
+	std::vector<GcWorker>& get_gc_workers()
+	{
+		static std::vector<GcWorker> workers(GC_WORKER_THREADS > 0 ? GC_WORKER_THREADS : std::max(1u, std::thread::hardware_concurrency()));
+		return workers;
+	}
+
+	// Runs function(index) for every worker, with the calling thread acting as the first one
+	template<typename Function>
+	void run_gc_workers(Function function)
+	{
+		std::vector<std::thread> threads;
+		for (std::size_t index = 1; index < get_gc_workers().size(); ++index)
+		{
+			threads.emplace_back(function, index);
+		}
+
+		function(0);
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	void share_gray_objects(GcWorker& worker)
+	{
+		std::lock_guard<std::mutex> lock{worker.shared_mutex};
+
+		auto first = worker.gray_objects.end() - STEAL_BATCH_SIZE;
+		worker.shared_objects.insert(worker.shared_objects.end(), first, worker.gray_objects.end());
+		worker.gray_objects.erase(first, worker.gray_objects.end());
+		worker.shared_count = worker.shared_objects.size();
+	}
+
+	bool take_shared_objects(GcWorker& from, GcWorker& into)
+	{
+		if (from.shared_count == 0)
+		{
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock{from.shared_mutex};
+		if (from.shared_objects.empty())
+		{
+			return false;
+		}
+
+		into.gray_objects.insert(into.gray_objects.end(), from.shared_objects.begin(), from.shared_objects.end());
+		from.shared_objects.clear();
+		from.shared_count = 0;
+		return true;
+	}
+
+	void mark_in_worker(GcWorker& worker, Object* object)
+	{
+		// Several workers may reach the same object at once, but only one of them gets to set its mark
+		u64 bit;
+		std::atomic_ref<u64> word{mark_word(object, bit)};
+		if ((word.fetch_or(bit, std::memory_order_relaxed) & bit) != 0)
+		{
+			return;
+		}
+
+		worker.gray_objects.push_back(object);
+		if (worker.gray_objects.size() >= 2 * STEAL_BATCH_SIZE && worker.shared_count == 0)
+		{
+			share_gray_objects(worker);
+		}
+	}
+
+	void run_mark_worker(std::size_t index)
+	{
+		std::vector<GcWorker>& workers = get_gc_workers();
+		GcWorker& worker = workers[index];
+		current_worker = &worker;
+
+		while (true)
+		{
+			while (worker.gray_objects.size() > 0)
+			{
+				Object* object = worker.gray_objects.back();
+				worker.gray_objects.pop_back();
+
+				blacken_object(object);
+			}
+
+			bool found_work = false;
+			for (std::size_t offset = 0; offset < workers.size() && !found_work; ++offset)
+			{
+				found_work = take_shared_objects(workers[(index + offset) % workers.size()], worker);
+			}
+
+			if (found_work)
+			{
+				continue;
+			}
+
+			// Only busy workers can come up with more gray objects, so we're done once all of them are idle at the same time
+			++idle_workers;
+			while (idle_workers < workers.size() && std::none_of(workers.begin(), workers.end(), [](const GcWorker& other) { return other.shared_count > 0; }))
+			{
+				std::this_thread::yield();
+			}
+
+			if (idle_workers == workers.size())
+			{
+				break;
+			}
+
+			--idle_workers;
+		}
+
+		current_worker = nullptr;
+	}
+
+	void trace_references_parallel()
+	{
+		std::vector<GcWorker>& workers = get_gc_workers();
+		for (std::size_t index = 0; index < vm.gray_stack.size(); ++index)
+		{
+			workers[index % workers.size()].gray_objects.push_back(vm.gray_stack[index]);
+		}
+		vm.gray_stack.clear();
+
+		idle_workers = 0;
+		run_gc_workers(run_mark_worker);
+	}
+
+	void sweep_parallel()
+	{
+		std::vector<GcWorker>& workers = get_gc_workers();
+		run_gc_workers(
+			[&workers](std::size_t index)
+			{
+				for (std::size_t page_index = index; page_index < pages.size(); page_index += workers.size())
+				{
+					if (!pages[page_index]->is_swept)
+					{
+						sweep_page(pages[page_index], workers[index].swept);
+					}
+				}
+			});
+
+		for (GcWorker& worker : workers)
+		{
+			reuse_swept_cells(worker.swept);
+		}
+	}
+
+	enum class PauseKind : u8
+	{
+		MINOR,
+		MARK_START,
+		MARK_STEP,
+		REMARK,
+		SWEEP_STEP,
+		FULL,
+		COMPACT,
+		COUNT
+	};
+
+	constexpr const char* PAUSE_KIND_NAMES[] = {"minor", "mark start", "mark step", "remark", "sweep step", "full", "compact"};
+
+	// Bucket 0 counts pauses below 1us, and bucket n the ones between 2^(n-1) and 2^n us. The last one takes everything longer
+	constexpr std::size_t PAUSE_HISTOGRAM_SIZE = 20;
+
+	struct PauseStats
+	{
+		u64 count = 0;
+		f64 total_us = 0.0;
+		f64 max_us = 0.0;
+	};
+
+	std::array<PauseStats, (std::size_t)PauseKind::COUNT> pause_stats;
+	std::array<u64, PAUSE_HISTOGRAM_SIZE> pause_histogram{};
+
+	// Records how long the program was stopped for, from construction until the end of the scope
+	struct PauseTimer
+	{
+		PauseKind kind;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		~PauseTimer()
+		{
+			f64 us = std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+			PauseStats& stats = pause_stats[(std::size_t)kind];
+			++stats.count;
+			stats.total_us += us;
+			stats.max_us = std::max(stats.max_us, us);
+
+			std::size_t bucket = us < 1.0 ? 0 : std::min<std::size_t>(std::bit_width((u64)us), PAUSE_HISTOGRAM_SIZE - 1);
+			++pause_histogram[bucket];
+		}
+	};
+
+	// Tells an incremental step when to hand control back to the program. Reading the clock isn't
+	// free compared to marking or sweeping a single object, so we only look at it every so often
+	struct PauseBudget
+	{
+		std::chrono::steady_clock::time_point deadline;
+		u32 work = 0;
+
+		PauseBudget(f64 budget_us = gc_policy.max_pause_us)
+			: deadline(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<f64, std::micro>{budget_us}))
+		{
+		}
+
+		bool exhausted()
+		{
+			// Under stress, take tiny steps so that the program gets to run (and mess with the heap) in between as much as possible
+			if (gc_policy.stress)
+			{
+				return ++work >= 4;
+			}
+
+			return ++work % 64 == 0 && std::chrono::steady_clock::now() >= deadline;
+		}
+
+		// For work that comes in bigger chunks than single objects
+		bool past_deadline() const
+		{
+			return gc_policy.stress || std::chrono::steady_clock::now() >= deadline;
+		}
+	};
+
+	enum class Phase : u8
+	{
+		IDLE,
+		MARKING,
+		SWEEPING
+	};
+
+	Phase phase = Phase::IDLE;
+
+	// The pages the current cycle still has to sweep. Pages allocated after marking is done never need sweeping
+	std::size_t sweep_cursor = 0;
+	std::size_t sweep_end = 0;
+	std::size_t unswept_page_count = 0;
+
+	std::size_t live_heap_bytes = 0;	// What survived the last cycle
+	std::size_t next_snapshot_heap_bytes = 0;	 // Live heap that asks for another snapshot, once gc_policy.snapshot_heap_bytes was reached
+	std::size_t cycle_start_allocated_bytes = 0;
+	std::size_t last_cycle_allocated_bytes = 0;
+
+	std::size_t clamp_to_heap_limit(std::size_t heap_bytes)
+	{
+		return gc_policy.heap_limit_bytes > 0 ? std::min(heap_bytes, gc_policy.heap_limit_bytes) : heap_bytes;
+	}
+
+	// How far the heap may grow before the next cycle has to be done
+	std::size_t heap_goal()
+	{
+		std::size_t goal = std::max((std::size_t)((f64)total_heap_bytes * gc_policy.heap_grow_factor), gc_policy.min_heap_bytes);
+		if (gc_policy.max_heap_bytes > 0)
+		{
+			goal = std::min(goal, gc_policy.max_heap_bytes);
+		}
+
+		// Don't end up collecting on every single allocation once the live heap grew past max_heap_bytes. Past the heap
+		// limit that's exactly what we want though, as every safepoint needs to check whether the script is over it
+		return clamp_to_heap_limit(std::max(goal, total_heap_bytes + gc_policy.step_bytes));
+	}
+
+	// An incremental cycle that starts when the heap reaches its goal lets the heap grow past it while running. The pacer
+	// starts it early instead, by as much as the program allocated during the last cycle, so that it's likely done by the
+	// time the heap gets there. It never starts the cycle before the heap grew halfway to the goal though
+	std::size_t next_cycle_trigger()
+	{
+		std::size_t goal = heap_goal();
+#if USE_INCREMENTAL_GC
+		if (gc_policy.use_pacer && goal > total_heap_bytes)
+		{
+			std::size_t growth = goal - total_heap_bytes;
+			return total_heap_bytes + std::max(growth / 2, growth - std::min(growth, last_cycle_allocated_bytes));
+		}
+#endif
+		return goal;
+	}
+
+	// Sweeping is lazy: Once marking is done, pages with garbage in them are only queued up with their size class, for
+	// allocate_old() to sweep whenever it runs out of free cells. Incremental steps sweep them in the background as well,
+	// and whatever is left gets swept in one go before the next cycle starts marking. The bytes taken by garbage are
+	// given back right away though, so that the next collection is scheduled by how much survived this one
+	void queue_sweeping()
+	{
+		for (Page* page : pages)
+		{
+			std::size_t unreached_cells = 0;
+			for (std::size_t word = 0; word < PAGE_BITMAP_WORDS; ++word)
+			{
+				unreached_cells += (std::size_t)std::popcount(page->allocated[word] & ~page->marks[word]);
+			}
+
+			if (unreached_cells == 0)
+			{
+				page->marks = {};
+				continue;
+			}
+
+			total_heap_bytes -= unreached_cells * page->cell_size;
+			page->is_swept = false;
+			size_classes[page->size_class].unswept_pages.push_back(page);
+			++unswept_page_count;
+		}
+
+		live_heap_bytes = total_heap_bytes;
+
+		// Every time the live heap doubles from snapshot_at on, so that a leak leaves a trail of snapshots to compare
+		if (gc_policy.snapshot_heap_bytes > 0 && live_heap_bytes > std::max(gc_policy.snapshot_heap_bytes, next_snapshot_heap_bytes))
+		{
+			next_snapshot_heap_bytes = live_heap_bytes * 2;
+			heap_snapshot_requested = true;
+		}
+
+		sweep_cursor = 0;
+		sweep_end = pages.size();
+		phase = Phase::SWEEPING;
+
+#if USE_COMPACTING_GC
+		compaction_pending = !select_evacuation_pages().empty();
+#endif
+	}
+
+	// Sweeps the queued pages of the size class until it has a free cell again, if any of them has one
+	void sweep_for_allocation(SizeClass& size_class)
+	{
+		SweptCells swept;
+		while (size_class.free_cells == nullptr && !size_class.unswept_pages.empty())
+		{
+			Page* page = size_class.unswept_pages.back();
+			size_class.unswept_pages.pop_back();
+
+			if (!page->is_swept)
+			{
+				sweep_page(page, swept);
+				reuse_swept_cells(swept);
+				--unswept_page_count;
+			}
+		}
+	}
+
+	void finish_sweeping()
+	{
+		for (SizeClass& size_class : size_classes)
+		{
+			size_class.unswept_pages.clear();
+		}
+		unswept_page_count = 0;
+		phase = Phase::IDLE;
+		last_cycle_allocated_bytes = allocated_bytes - cycle_start_allocated_bytes;
+
+		release_empty_pages();
+
+#if DEBUG_LOG_GC
+		std::cout << std::format("-- gc cycle end, heap at {}\n", (std::size_t)total_heap_bytes);
+#endif
+	}
+
+	// With USE_CONCURRENT_GC, the gray stack is drained by a separate thread while the program keeps running.
+	// heap_mutex keeps it from running at the same time as anything that changes references (see HeapWriteLock),
+	// and makes the marks and the gray stack safe to share
+	constexpr i32 MARKER_BATCH_SIZE = 256;
+
+	std::recursive_mutex heap_mutex;	// Recursive, as allocating black during a minor collection locks it again
+	std::thread marker_thread;
+	std::atomic<bool> marker_done = false;
+	bool marker_running = false;	// Only ever touched by the program's own thread
+
+	void run_marker()
+	{
+		while (true)
+		{
+			// Let go of the lock every so often, so that the program doesn't have to wait for long on stores
+			std::lock_guard<std::recursive_mutex> lock{heap_mutex};
+			for (i32 count = 0; count < MARKER_BATCH_SIZE; ++count)
+			{
+				if (vm.gray_stack.empty())
+				{
+					marker_done = true;
+					return;
+				}
+
+				Object* object = vm.gray_stack.back();
+				vm.gray_stack.pop_back();
+
+				blacken_object(object);
+			}
+		}
+	}
+
+	// Only the program's own thread ever shades objects other than the marker thread, and it's stuck waiting in here,
+	// so the marker thread is bound to run out of gray objects eventually
+	void stop_marker()
+	{
+		if (marker_running)
+		{
+			marker_thread.join();
+			marker_running = false;
+		}
+	}
+
+	void start_marker()
+	{
+		// exit() doesn't unwind the stack, and destroying a std::thread that's still running terminates the process
+		static bool registered_at_exit = false;
+		if (!registered_at_exit)
+		{
+			std::atexit(stop_marker);
+			registered_at_exit = true;
+		}
+
+		marker_done = false;
+		marker_running = true;
+		marker_thread = std::thread{run_marker};
+	}
+
+	// Marking is snapshot-at-the-beginning: Everything reachable from the roots when the cycle starts survives it, with
+	// write_barrier() shading any reference the program overwrites in the meantime, and new objects being allocated black
+	void begin_marking()
+	{
+		PauseTimer timer{PauseKind::MARK_START};
+
+#if DEBUG_LOG_GC
+		std::cout << "-- gc cycle begin\n";
+#endif
+
+		gc_marking = true;
+		phase = Phase::MARKING;
+		cycle_start_allocated_bytes = allocated_bytes;
+
+#if USE_CONCURRENT_GC
+		// The compiler keeps adding constants to the functions it's working on, so we scan those right away instead of
+		// letting the marker thread race with it. Whatever it adds later is either new, or an interned string that gets
+		// shaded when it's looked up
+		mark_compiler_roots();
+
+		std::vector<Object*> in_progress;
+		std::swap(in_progress, vm.gray_stack);
+		for (Object* object : in_progress)
+		{
+			blacken_object(object);
+		}
+#endif
+
+		mark_roots();
+
+		// Young objects can't be marked, as minor collections move them around in the middle of the cycle. Instead we
+		// treat them all as roots: Young objects allocated later can only point at objects that survive the cycle anyway
+		for (Object* object : vm.young_objects)
+		{
+			blacken_object(object);
+		}
+
+#if USE_CONCURRENT_GC
+		start_marker();
+#endif
+	}
+
+	void finish_marking()
+	{
+		remove_unreferenced_strings(vm.strings);
+		std::erase_if(vm.remembered_objects, [](const Object* object) { return !is_marked(object); });
+
+		gc_marking = false;
+		queue_sweeping();
+	}
+
+	void mark_step()
+	{
+		PauseTimer timer{PauseKind::MARK_STEP};
+		PauseBudget budget;
+
+		while (vm.gray_stack.size() > 0)
+		{
+			Object* object = vm.gray_stack.back();
+			vm.gray_stack.pop_back();
+
+			blacken_object(object);
+
+			if (budget.exhausted())
+			{
+				return;
+			}
+		}
+
+		finish_marking();
+	}
+
+	void remark()
+	{
+		PauseTimer timer{PauseKind::REMARK};
+
+		stop_marker();
+
+		// Whatever the barriers shaded after the marker thread ran out of work
+		trace_references();
+		finish_marking();
+	}
+
+	void sweep_step()
+	{
+		PauseTimer timer{PauseKind::SWEEP_STEP};
+		PauseBudget budget;
+
+		SweptCells swept;
+		while (unswept_page_count > 0 && sweep_cursor < sweep_end)
+		{
+			Page* page = pages[sweep_cursor++];
+			if (page->is_swept)
+			{
+				continue;	 // Already swept by an allocation
+			}
+
+			sweep_page(page, swept);
+			--unswept_page_count;
+			if (budget.past_deadline())
+			{
+				break;
+			}
+		}
+		reuse_swept_cells(swept);
+
+		if (unswept_page_count == 0)
+		{
+			finish_sweeping();
+		}
+	}
+
+	// Runs whatever is left of the current cycle in one go
+	void finish_cycle()
+	{
+		if (phase == Phase::MARKING)
+		{
+			stop_marker();
+			trace_references();
+			finish_marking();
+		}
+
+		if (phase == Phase::SWEEPING)
+		{
+#if USE_PARALLEL_GC
+			sweep_parallel();
+#else
+			sweep();
+#endif
+			finish_sweeping();
+		}
+	}
+
+	std::size_t object_size(const Object* object)
+	{
+		switch (object->type)
+		{
+			case ObjectType::STRING:
+			{
+				return sizeof(ObjectString);
+			}
+			case ObjectType::FUNCTION:
+			{
+				return sizeof(ObjectFunction);
+			}
+			case ObjectType::UPVALUE:
+			{
+				return sizeof(ObjectUpvalue);
+			}
+			case ObjectType::CLOSURE:
+			{
+				return sizeof(ObjectClosure);
+			}
+			case ObjectType::NATIVE_FUNCTION:
+			{
+				return sizeof(ObjectNativeFunction);
+			}
+			case ObjectType::CLASS:
+			{
+				return sizeof(ObjectClass);
+			}
+			case ObjectType::INSTANCE:
+			{
+				return sizeof(ObjectInstance);
+			}
+			case ObjectType::BOUND_METHOD:
+			{
+				return sizeof(ObjectBoundMethod);
+			}
+			case ObjectType::FORWARDED:
+			{
+				return sizeof(ObjectForwarded);
+			}
+		}
+
+		return 0;
+	}
+
+	// What an object takes up on the heap itself, which is its whole cell for old objects
+	std::size_t object_heap_bytes(const Object* object)
+	{
+		return object->is_young ? (object_size(object) + CELL_GRANULE - 1) & ~(CELL_GRANULE - 1) : page_of(object)->cell_size;
+	}
+
+	// Short strings are stored inside the Lox::String itself, and only longer ones allocate their characters
+	std::size_t string_chars_bytes(const ObjectString* string)
+	{
+		const Lox::String& chars = string->get_string();
+		const char* inline_begin = reinterpret_cast<const char*>(string);
+		bool is_inline = chars.data() >= inline_begin && chars.data() < inline_begin + sizeof(ObjectString);
+		return is_inline ? 0 : chars.capacity() + 1;
+	}
+
+	// Tables only tell us how many entries and buckets they have, and the allocator only counts bytes for all tables of a
+	// kind together, so this estimates the bytes of a single table from the layout of libstdc++: Every entry is a node of its
+	// own that also holds a pointer to the next one, and a table with a single bucket doesn't allocate it. Other standard
+	// libraries lay them out differently, so everything built on this is labeled as an estimate
+	template<typename TTable>
+	std::size_t estimate_table_bytes(const TTable& table)
+	{
+		using Entry = typename TTable::value_type;
+		std::size_t node_bytes = (sizeof(void*) + sizeof(Entry) + alignof(Entry) - 1) & ~(alignof(Entry) - 1);
+		return table.size() * node_bytes + (table.bucket_count() > 1 ? table.bucket_count() * sizeof(void*) : 0);
+	}
+
+	// Builds the name from the ObjectString directly, as to_string() would allocate on the heap we're taking the census of
+	std::string function_name(const ObjectFunction* function)
+	{
+		return function->name != nullptr ? std::format("<fn {}>", std::string_view{function->name->get_string()}) : "<script>";
+	}
+
+	std::string length_bucket_name(std::size_t bucket)
+	{
+		return bucket == 0 ? "strings of 0-7 chars" : std::format("strings of {}-{} chars", 4ull << bucket, (8ull << bucket) - 1);
+	}
+
+	struct CensusBuilder
+	{
+		HeapCensus census;
+		std::array<HeapCensusEntry, (std::size_t)ObjectType::FORWARDED> objects;
+		std::unordered_map<const ObjectClass*, HeapCensusEntry> classes;
+		std::unordered_map<const ObjectFunction*, HeapCensusEntry> closures;
+		std::vector<HeapCensusEntry> strings;
+		std::size_t young_bytes = 0;
+
+		void add(const Object* object)
+		{
+			std::size_t bytes = object_heap_bytes(object);
+			if (object->is_young)
+			{
+				young_bytes += bytes;
+			}
+
+			objects[(std::size_t)object->type].count++;
+			objects[(std::size_t)object->type].bytes += bytes;
+
+			switch (object->type)
+			{
+				case ObjectType::STRING:
+				{
+					const ObjectString* string = static_cast<const ObjectString*>(object);
+					std::size_t length = string->get_string().size();
+					std::size_t bucket = length < 8 ? 0 : (std::size_t)std::bit_width(length) - 3;
+					if (strings.size() <= bucket)
+					{
+						strings.resize(bucket + 1);
+					}
+					strings[bucket].count++;
+					strings[bucket].bytes += bytes + string_chars_bytes(string);
+					break;
+				}
+				case ObjectType::CLOSURE:
+				{
+					const ObjectClosure* closure = static_cast<const ObjectClosure*>(object);
+					HeapCensusEntry& entry = closures[closure->function];
+					entry.count++;
+					entry.bytes += bytes + closure->upvalues.capacity() * sizeof(closure->upvalues[0]);
+					break;
+				}
+				case ObjectType::INSTANCE:
+				{
+					const ObjectInstance* instance = static_cast<const ObjectInstance*>(object);
+					HeapCensusEntry& entry = classes[instance->klass];
+					entry.count++;
+					entry.bytes += bytes + estimate_table_bytes(instance->fields);
+					break;
+				}
+				default:
+				{
+					break;
+				}
+			}
+		}
+
+		HeapCensus finish()
+		{
+			census.total_bytes = total_heap_bytes;
+
+			for (std::size_t type = 0; type < objects.size(); ++type)
+			{
+				objects[type].name = OBJECT_TYPE_NAMES[type];
+				census.objects.push_back(objects[type]);
+			}
+
+			for (std::size_t use = 0; use < heap_use_bytes.size(); ++use)
+			{
+				census.containers.push_back(HeapCensusEntry{HEAP_USE_NAMES[use], 0, heap_use_bytes[use]});
+			}
+
+			// The nursery counts against the heap as a whole, so whatever its objects don't use is overhead as well
+			census.containers.push_back(HeapCensusEntry{"nursery slack", 0, nursery.blocks.size() * NURSERY_BLOCK_SIZE - young_bytes});
+
+			// Classes and functions that share a name share an entry as well, so that find() gives the whole picture
+			std::unordered_map<std::string, std::size_t> indices;
+			auto add_by_name = [&indices](std::vector<HeapCensusEntry>& entries, std::string name, const HeapCensusEntry& entry)
+			{
+				auto [iter, inserted] = indices.try_emplace(name, entries.size());
+				if (inserted)
+				{
+					entries.push_back(HeapCensusEntry{std::move(name), 0, 0});
+				}
+				entries[iter->second].count += entry.count;
+				entries[iter->second].bytes += entry.bytes;
+			};
+
+			for (const auto& [klass, entry] : classes)
+			{
+				add_by_name(census.classes, std::format("instances of {}", std::string_view{klass->name->get_string()}), entry);
+			}
+
+			for (std::size_t bucket = 0; bucket < strings.size(); ++bucket)
+			{
+				if (strings[bucket].count > 0)
+				{
+					strings[bucket].name = length_bucket_name(bucket);
+					census.strings.push_back(std::move(strings[bucket]));
+				}
+			}
+
+			for (const auto& [function, entry] : closures)
+			{
+				add_by_name(census.closures, std::format("closures of {}", function_name(function)), entry);
+			}
+
+			// The biggest ones are what we're usually after
+			auto by_bytes = [](const HeapCensusEntry& a, const HeapCensusEntry& b) { return a.bytes > b.bytes; };
+			std::sort(census.classes.begin(), census.classes.end(), by_bytes);
+			std::sort(census.closures.begin(), census.closures.end(), by_bytes);
+
+			return std::move(census);
+		}
+	};
+
+	// Strings longer than this only have their start in a heap snapshot
+	constexpr std::size_t SNAPSHOT_STRING_CHARS = 80;
+
+	void write_json_string(std::ostream& stream, std::string_view text)
+	{
+		stream << '"';
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+			{
+				stream << '\\' << c;
+			}
+			else if ((unsigned char)c < 0x20)
+			{
+				stream << "\\u00" << "0123456789abcdef"[(unsigned char)c >> 4] << "0123456789abcdef"[c & 0xf];
+			}
+			else
+			{
+				stream << c;
+			}
+		}
+		stream << '"';
+	}
+
+	// Numbers the objects in the order a breadth first search from the roots reaches them, so that the first reference
+	// to each object is the last step of a shortest path from the roots to it. Each object is written out as soon as its
+	// turn comes, as every object it references has a number by then
+	struct SnapshotWriter
+	{
+		struct Retainer
+		{
+			bool is_root = false;
+			std::size_t from = 0;	 // Index of the root, or id of the object
+			std::size_t reference = 0;	  // Index into the references of that object
+		};
+
+		std::ostream& stream;
+		std::unordered_map<const Object*, std::size_t> ids{};
+		std::vector<Object*> objects{};
+		std::vector<Retainer> retainers{};
+		std::size_t reachable_bytes = 0;
+
+		// Where the references currently being visited are stored
+		bool visiting_roots = true;
+		std::size_t visited_id = 0;
+		std::size_t reference_count = 0;
+
+		void object(Object* object, const Reference& reference)
+		{
+			if (object == nullptr)
+			{
+				return;
+			}
+
+			auto [iter, inserted] = ids.try_emplace(object, objects.size());
+			if (inserted)
+			{
+				objects.push_back(object);
+				retainers.push_back(Retainer{visiting_roots, visiting_roots ? reference_count : visited_id, reference_count});
+			}
+
+			stream << (reference_count > 0 ? "," : "") << (visiting_roots ? "\n" : "") << "{\"kind\":\"" << reference.kind << '"';
+			if (reference.name != nullptr)
+			{
+				stream << ",\"name\":";
+				write_json_string(stream, reference.name->get_string());
+			}
+			if (reference.index >= 0)
+			{
+				stream << ",\"index\":" << reference.index;
+			}
+			stream << ",\"to\":" << iter->second << '}';
+			++reference_count;
+		}
+
+		void value(const Value& value, const Reference& reference)
+		{
+			if (is_object(value))
+			{
+				object(as_object(value), reference);
+			}
+		}
+
+		// What an object owns outside of its cell, the same way the census counts it
+		std::size_t owned_bytes(const Object* object)
+		{
+			switch (object->type)
+			{
+				case ObjectType::STRING:
+				{
+					return string_chars_bytes(static_cast<const ObjectString*>(object));
+				}
+				case ObjectType::FUNCTION:
+				{
+					const Chunk& chunk = static_cast<const ObjectFunction*>(object)->chunk;
+					return chunk.code.capacity() * sizeof(chunk.code[0]) + chunk.lines.capacity() * sizeof(chunk.lines[0]) +
+						chunk.constants.capacity() * sizeof(chunk.constants[0]);
+				}
+				case ObjectType::CLOSURE:
+				{
+					const ObjectClosure* closure = static_cast<const ObjectClosure*>(object);
+					return closure->upvalues.capacity() * sizeof(closure->upvalues[0]);
+				}
+				case ObjectType::CLASS:
+				{
+					return estimate_table_bytes(static_cast<const ObjectClass*>(object)->methods);
+				}
+				case ObjectType::INSTANCE:
+				{
+					return estimate_table_bytes(static_cast<const ObjectInstance*>(object)->fields);
+				}
+				default:
+				{
+					return 0;
+				}
+			}
+		}
+
+		// Whatever tells objects of the same type apart, built from the objects directly so that nothing gets allocated on the heap
+		void write_details(const Object* object)
+		{
+			switch (object->type)
+			{
+				case ObjectType::STRING:
+				{
+					std::string_view text{static_cast<const ObjectString*>(object)->get_string()};
+					stream << ",\"length\":" << text.size() << ",\"value\":";
+					write_json_string(stream, text.substr(0, SNAPSHOT_STRING_CHARS));
+					break;
+				}
+				case ObjectType::FUNCTION:
+				{
+					stream << ",\"name\":";
+					write_json_string(stream, function_name(static_cast<const ObjectFunction*>(object)));
+					break;
+				}
+				case ObjectType::UPVALUE:
+				{
+					const ObjectUpvalue* upvalue = static_cast<const ObjectUpvalue*>(object);
+					stream << ",\"open\":" << (upvalue->location != &upvalue->closed ? "true" : "false");
+					break;
+				}
+				case ObjectType::CLOSURE:
+				{
+					stream << ",\"function\":";
+					write_json_string(stream, function_name(static_cast<const ObjectClosure*>(object)->function));
+					break;
+				}
+				case ObjectType::CLASS:
+				{
+					stream << ",\"name\":";
+					write_json_string(stream, static_cast<const ObjectClass*>(object)->name->get_string());
+					break;
+				}
+				case ObjectType::INSTANCE:
+				{
+					stream << ",\"class\":";
+					write_json_string(stream, static_cast<const ObjectInstance*>(object)->klass->name->get_string());
+					break;
+				}
+				case ObjectType::BOUND_METHOD:
+				{
+					stream << ",\"method\":";
+					write_json_string(stream, function_name(static_cast<const ObjectBoundMethod*>(object)->method->function));
+					break;
+				}
+				default:
+				{
+					break;
+				}
+			}
+		}
+
+		void write()
+		{
+			stream << "{\"format\":\"clox heap snapshot\",\"version\":1,\"heap_bytes\":" << total_heap_bytes << ",\n\"roots\":[";
+			for_each_root(*this);
+			stream << "],\n\"objects\":[";
+
+			visiting_roots = false;
+			for (visited_id = 0; visited_id < objects.size(); ++visited_id)
+			{
+				Object* object = objects[visited_id];
+				std::size_t bytes = object_heap_bytes(object);
+				std::size_t owned = owned_bytes(object);
+				reachable_bytes += bytes + owned;
+
+				const Retainer& retainer = retainers[visited_id];
+				stream << (visited_id > 0 ? ",\n" : "\n") << "{\"id\":" << visited_id << ",\"type\":\"" << OBJECT_TYPE_NAMES[(std::size_t)object->type]
+					   << "\",\"size\":" << bytes << ",\"owned\":" << owned;
+				write_details(object);
+				stream << ",\"retainer\":{\"" << (retainer.is_root ? "root" : "object") << "\":" << retainer.from;
+				if (!retainer.is_root)
+				{
+					stream << ",\"reference\":" << retainer.reference;
+				}
+				stream << "},\"references\":[";
+
+				reference_count = 0;
+				for_each_reference(object, *this);
+				stream << "]}";
+			}
+
+			stream << "],\n\"object_count\":" << objects.size() << ",\"reachable_bytes\":" << reachable_bytes << "}\n";
+		}
+	};
+}	 // namespace MemoryImpl
+
+void Lox::mark_object(Object* object)
+{
+#if USE_PARALLEL_GC
+	if (MemoryImpl::current_worker != nullptr)
+	{
+		if (object != nullptr)
+		{
+			MemoryImpl::mark_in_worker(*MemoryImpl::current_worker, object);
+		}
+		return;
+	}
+#endif
+
+	// Incremental cycles leave young objects alone, see begin_marking()
+	if (object == nullptr || (gc_marking && object->is_young) || MemoryImpl::set_marked(object))
+	{
+		return;
+	}
+
+#if DEBUG_LOG_GC && !USE_CONCURRENT_GC && !USE_PARALLEL_GC
+	std::cout << std::format("{} mark {}", (void*)object, Lox::to_string(object)) << std::endl;
+#endif
+
+	vm.gray_stack.push_back(object);
+}
+
+void Lox::mark_value(Value value)
+{
+	if (is_object(value))
+	{
+		Object* object = as_object(value);
+		mark_object(object);
+	}
+}
+
+void Lox::collect_garbage()
+{
+	using namespace MemoryImpl;
+
+	// The marks and the half-swept pages of an incremental cycle would get in the way of a full collection
+	finish_cycle();
+
+	PauseTimer timer{PauseKind::FULL};
+
+#if DEBUG_LOG_GC
+	std::cout << "-- gc begin\n";
+	std::size_t before = total_heap_bytes;
+#endif
+
+	mark_roots();
+#if USE_PARALLEL_GC
+	trace_references_parallel();
+#else
+	trace_references();
+#endif
+	remove_unreferenced_strings(vm.strings);
+
+	// Dead old objects can't point at anything anymore
+	std::erase_if(vm.remembered_objects, [](const Object* object) { return !is_marked(object); });
+
+	queue_sweeping();
+
+	// Young objects aren't swept, as the nursery is only ever emptied by collect_nursery(). Dead young objects may
+	// point at the old objects we're about to free though, so we destroy them right away instead of leaving them for
+	// the next minor collection, as the next incremental cycle would otherwise follow those pointers
+	std::erase_if(vm.young_objects,
+				  [](Object* object)
+				  {
+					  if (is_marked(object))
+					  {
+						  return false;
+					  }
+
+					  object->destroy();
+					  return true;
+				  });
+
+	for (NurseryBlock* block : nursery.blocks)
+	{
+		block->marks = {};
+	}
+
+	next_gc = next_cycle_trigger();
+
+#if DEBUG_LOG_GC
+	std::cout << "-- gc end\n";
+	std::cout << std::format("   collected {} bytes (from {} to {}), next at {}\n", before - total_heap_bytes, before, (std::size_t)total_heap_bytes, next_gc);
+#endif
+}
+
+void Lox::gc_step()
+{
+#if USE_INCREMENTAL_GC
+	using namespace MemoryImpl;
+
+	switch (phase)
+	{
+		case Phase::IDLE:
+		{
+			begin_marking();
+			break;
+		}
+		case Phase::MARKING:
+		{
+#if USE_CONCURRENT_GC
+			if (marker_done)
+			{
+				remark();
+			}
+#else
+			mark_step();
+#endif
+			break;
+		}
+		case Phase::SWEEPING:
+		{
+			sweep_step();
+			break;
+		}
+	}
+
+	// Keep taking steps at a steady pace until the cycle is done, and only then let the heap grow
+	next_gc = phase == Phase::IDLE ? next_cycle_trigger() : clamp_to_heap_limit(total_heap_bytes + gc_policy.step_bytes);
+#else
+	collect_garbage();
+#endif
+}
+
+void Lox::print_gc_stats()
+{
+	using namespace MemoryImpl;
+
+	std::cerr << std::format("{:<12}{:>10}{:>14}{:>12}{:>12}\n", "gc pause", "count", "total us", "mean us", "max us");
+	for (std::size_t kind = 0; kind < pause_stats.size(); ++kind)
+	{
+		const PauseStats& stats = pause_stats[kind];
+		if (stats.count > 0)
+		{
+			std::cerr << std::format("{:<12}{:>10}{:>14.1f}{:>12.1f}{:>12.1f}\n", PAUSE_KIND_NAMES[kind], stats.count, stats.total_us,
+									 stats.total_us / (f64)stats.count, stats.max_us);
+		}
+	}
+
+	std::cerr << "gc pause histogram\n";
+	for (std::size_t bucket = 0; bucket < pause_histogram.size(); ++bucket)
+	{
+		if (pause_histogram[bucket] == 0)
+		{
+			continue;
+		}
+
+		if (bucket == 0)
+		{
+			std::cerr << std::format("{:>22}{:>10}\n", "< 1 us", pause_histogram[bucket]);
+		}
+		else if (bucket == pause_histogram.size() - 1)
+		{
+			std::cerr << std::format("{:>22}{:>10}\n", std::format(">= {} us", 1ull << (bucket - 1)), pause_histogram[bucket]);
+		}
+		else
+		{
+			std::cerr << std::format("{:>22}{:>10}\n", std::format("{} - {} us", 1ull << (bucket - 1), 1ull << bucket), pause_histogram[bucket]);
+		}
+	}
+}
+
+const Lox::HeapCensusEntry* Lox::HeapCensus::find(std::string_view name) const
+{
+	for (const std::vector<HeapCensusEntry>* section : {&objects, &containers, &classes, &strings, &closures})
+	{
+		for (const HeapCensusEntry& entry : *section)
+		{
+			if (entry.name == name)
+			{
+				return &entry;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+void Lox::collect_all_garbage()
+{
+	collect_garbage();
+	MemoryImpl::finish_cycle();
+}
+
+Lox::HeapCensus Lox::take_heap_census()
+{
+	using namespace MemoryImpl;
+
+	collect_all_garbage();
+
+	CensusBuilder builder;
+	for (Page* page : pages)
+	{
+		for_each_object(page, [&builder](Object* object) { builder.add(object); });
+	}
+
+	for (Object* object : vm.young_objects)
+	{
+		builder.add(object);
+	}
+
+	return builder.finish();
+}
+
+void Lox::print_heap_census()
+{
+	HeapCensus census = take_heap_census();
+
+	auto print_section = [](const char* title, const std::vector<HeapCensusEntry>& entries, bool has_counts)
+	{
+		std::cerr << title << "\n";
+		for (const HeapCensusEntry& entry : entries)
+		{
+			if (has_counts)
+			{
+				std::cerr << std::format("  {:<40}{:>12}{:>14}\n", entry.name, entry.count, entry.bytes);
+			}
+			else
+			{
+				std::cerr << std::format("  {:<40}{:>12}{:>14}\n", entry.name, "", entry.bytes);
+			}
+		}
+	};
+
+	std::cerr << std::format("{:<42}{:>12}{:>14}\n", "heap census", "count", "bytes");
+	std::cerr << std::format("{:<42}{:>12}{:>14}\n", "total", "", census.total_bytes);
+	print_section("objects", census.objects, true);
+	print_section("containers", census.containers, false);
+	print_section("instances by class (fields estimated)", census.classes, true);
+	print_section("strings by length", census.strings, true);
+	print_section("closures by function", census.closures, true);
+}
+
+bool Lox::write_heap_snapshot(const char* path)
+{
+	using namespace MemoryImpl;
+
+	std::ofstream stream{path, std::ios::trunc};
+	SnapshotWriter writer{stream};
+	writer.write();
+	return stream.good();
+}
+
+void Lox::write_requested_heap_snapshot()
+{
+	static i32 snapshot_count = 0;
+
+	heap_snapshot_requested = false;
+
+	std::string path = std::format("{}.{}.heap.json", heap_snapshot_prefix, ++snapshot_count);
+	if (write_heap_snapshot(path.c_str()))
+	{
+		std::cerr << "Wrote heap snapshot '" << path << "'" << std::endl;
+	}
+	else
+	{
+		std::cerr << "Could not write heap snapshot '" << path << "'" << std::endl;
+	}
+}
+
+bool Lox::configure_gc(const char* settings)
+{
+	using namespace MemoryImpl;
+
+	auto parse_number = [](std::string_view text, f64& number)
+	{
+		auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+		return error == std::errc{} && end == text.data() + text.size() && number >= 0;
+	};
+
+	auto parse_size = [&](std::string_view text, std::size_t& size)
+	{
+		f64 scale = 1;
+		std::size_t suffix = text.empty() ? std::string_view::npos : std::string_view{"KMG"}.find((char)std::toupper(text.back()));
+		if (suffix != std::string_view::npos)
+		{
+			scale = (f64)(1ull << (10 * (suffix + 1)));
+			text.remove_suffix(1);
+		}
+
+		f64 number = 0;
+		if (!parse_number(text, number))
+		{
+			return false;
+		}
+
+		size = (std::size_t)(number * scale);
+		return true;
+	};
+
+	auto parse_bool = [](std::string_view text, bool& flag)
+	{
+		flag = text == "1" || text == "on" || text == "true";
+		return flag || text == "0" || text == "off" || text == "false";
+	};
+
+	GcPolicy policy = gc_policy;
+	std::string_view rest{settings};
+	while (!rest.empty())
+	{
+		std::string_view setting = rest.substr(0, rest.find(','));
+		rest.remove_prefix(std::min(rest.size(), setting.size() + 1));
+		if (setting.empty())
+		{
+			continue;
+		}
+
+		std::size_t equals = setting.find('=');
+		std::string_view key = setting.substr(0, equals);
+		std::string_view value = equals != std::string_view::npos ? setting.substr(equals + 1) : std::string_view{};
+
+		bool valid = false;
+		if (key == "initial_heap")
+		{
+			valid = parse_size(value, policy.initial_heap_bytes);
+		}
+		else if (key == "grow_factor")
+		{
+			valid = parse_number(value, policy.heap_grow_factor) && policy.heap_grow_factor >= 1;
+		}
+		else if (key == "min_heap")
+		{
+			valid = parse_size(value, policy.min_heap_bytes);
+		}
+		else if (key == "max_heap")
+		{
+			valid = parse_size(value, policy.max_heap_bytes);
+		}
+		else if (key == "heap_limit")
+		{
+			valid = parse_size(value, policy.heap_limit_bytes);
+		}
+		else if (key == "snapshot_at")
+		{
+			valid = parse_size(value, policy.snapshot_heap_bytes);
+		}
+		else if (key == "region_max")
+		{
+			valid = parse_size(value, policy.region_max_bytes);
+		}
+		else if (key == "pacer")
+		{
+			valid = parse_bool(value, policy.use_pacer);
+		}
+		else if (key == "step_bytes")
+		{
+			valid = parse_size(value, policy.step_bytes) && policy.step_bytes > 0;
+		}
+		else if (key == "max_pause_us")
+		{
+			valid = parse_number(value, policy.max_pause_us);
+		}
+		else if (key == "retained_pages")
+		{
+			valid = parse_size(value, policy.retained_empty_pages);
+		}
+		else if (key == "stress")
+		{
+			valid = parse_bool(value, policy.stress);
+		}
+		else
+		{
+			std::cerr << std::format("Unknown GC setting '{}'.\n", key);
+			return false;
+		}
+
+		if (!valid)
+		{
+			std::cerr << std::format("Invalid value '{}' for GC setting '{}'.\n", value, key);
+			return false;
+		}
+	}
+
+	gc_policy = policy;
+	if (phase == Phase::IDLE)
+	{
+		next_gc = clamp_to_heap_limit(std::max(gc_policy.initial_heap_bytes, gc_policy.min_heap_bytes));
+	}
+	return true;
+}
+
+void Lox::collect_garbage_idle(f64 budget_us)
+{
+	using namespace MemoryImpl;
+
+	PauseBudget budget{budget_us};
+
+	if (!vm.young_objects.empty())
+	{
+		collect_nursery();
+	}
+
+#if USE_COMPACTING_GC
+	if (compaction_pending)
+	{
+		compact_heap();
+	}
+#endif
+
+	// Halfway is early enough that the program is unlikely to run into next_gc before the next idle period
+	if (phase == Phase::IDLE && total_heap_bytes * 2 < next_gc + live_heap_bytes)
+	{
+		return;
+	}
+
+#if USE_INCREMENTAL_GC
+	do
+	{
+		gc_step();
+	} while (phase != Phase::IDLE && !budget.past_deadline());
+#else
+	collect_garbage();
+#endif
+}
+
+void Lox::collect_requested_garbage()
+{
+	using namespace MemoryImpl;
+
+	gc_step();
+
+	// Allocations made by the collector itself don't need another collection
+	gc_requested = false;
+
+	if (gc_policy.heap_limit_bytes == 0 || total_heap_bytes <= gc_policy.heap_limit_bytes)
+	{
+		return;
+	}
+
+	// A nursery that a region filled past its usual size counts against the limit as a whole. Only VM safepoints may
+	// move what survives out of it, and the compiler gets here as well, so leave that to the next VM safepoint first
+	if (nursery.blocks_used > NURSERY_BLOCK_COUNT && !nursery_full)
+	{
+		nursery_full = true;
+		gc_requested = true;
+		return;
+	}
+
+	// Sweep right away as well, so that total_heap_bytes is as small as it gets
+	collect_all_garbage();
+	release_spare_nursery_blocks();
+	gc_requested = false;
+
+	if (total_heap_bytes > gc_policy.heap_limit_bytes)
+	{
+		throw HeapLimitExceeded{};
+	}
+}
+
+void* Lox::allocate_old(std::size_t size)
+{
+	using namespace MemoryImpl;
+
+	assert(size <= MAX_CELL_SIZE && "Objects must fit into the largest size class");
+
+	request_gc((size + CELL_GRANULE - 1) & ~(CELL_GRANULE - 1));
+
+	SizeClass& size_class = size_classes[(size + CELL_GRANULE - 1) / CELL_GRANULE - 1];
+	if (size_class.free_cells == nullptr)
+	{
+		sweep_for_allocation(size_class);
+	}
+
+	void* cell = size_class.free_cells;
+	if (cell != nullptr)
+	{
+		size_class.free_cells = next_free_cell(cell);
+	}
+	else
+	{
+		Page* page = size_class.bump_page;
+		if (page == nullptr || page->cells_used == page->cell_count)
+		{
+			page = allocate_page((size + CELL_GRANULE - 1) / CELL_GRANULE - 1);
+			size_class.bump_page = page;
+		}
+
+		cell = cell_at(page, page->cells_used++);
+	}
+
+	total_heap_bytes += page_of(cell)->cell_size;
+	allocated_bytes += page_of(cell)->cell_size;
+	return cell;
+}
+
+void Lox::add_old_object(Object* object)
+{
+	using namespace MemoryImpl;
+
+	Page* page = page_of(object);
+	std::size_t granule = granule_index(page, object);
+	page->allocated[granule / 64] |= 1ull << (granule % 64);
+
+	// Objects are allocated black while an incremental cycle is marking, as it's too late for it to find them through the
+	// roots, and in pages it didn't sweep yet, as it would take them for garbage otherwise. The marker thread may be
+	// setting other bits of the same bitmap word
+	if (gc_marking || !page->is_swept)
+	{
+		HeapWriteLock lock;
+		set_marked(object);
+	}
+}
+
+void* Lox::allocate_young(std::size_t size)
+{
+	using namespace MemoryImpl;
+
+	size = (size + CELL_GRANULE - 1) & ~(CELL_GRANULE - 1);
+	if (size > (std::size_t)(nursery.end - nursery.top))
+	{
+		if (!nursery_can_grow())
+		{
+			nursery_full = true;
+		}
+
+		if (nursery.blocks_used == nursery.blocks.size())
+		{
+			nursery.blocks.push_back(allocate_nursery_block());
+		}
+
+		u8* block = reinterpret_cast<u8*>(nursery.blocks[nursery.blocks_used++]);
+		nursery.top = block + NURSERY_HEADER_SIZE;
+		nursery.end = block + NURSERY_BLOCK_SIZE;
+	}
+
+	void* result = nursery.top;
+	nursery.top += size;
+	return result;
+}
+
+void Lox::collect_nursery()
+{
+	using namespace MemoryImpl;
+
+#if DEBUG_LOG_GC
+	std::cout << "-- minor gc begin\n";
+	std::size_t before = total_heap_bytes;
+	std::size_t young_count = vm.young_objects.size();
+	std::size_t promoted_count = 0;
+#endif
+
+	PauseTimer timer{PauseKind::MINOR};
+	HeapWriteLock lock;
+
+	forward_roots();
+	forward_remembered();
+
+	while (promoted_objects.size() > 0)
+	{
+		Object* object = promoted_objects.back();
+		promoted_objects.pop_back();
+
+		forward_references(object);
+#if DEBUG_LOG_GC
+		++promoted_count;
+#endif
+	}
+
+	// Everything left in the nursery is either garbage, or the forwarding address of a promoted object
+	for (Object* young_object : vm.young_objects)
+	{
+		Object* object = std::launder(young_object);
+		if (object->type != ObjectType::FORWARDED)
+		{
+			ObjectString* string = object_cast<ObjectString>(object);
+			auto iter = string != nullptr ? vm.strings.find(string->get_string()) : vm.strings.end();
+			if (iter != vm.strings.end() && iter->second == string)
+			{
+				vm.strings.erase(iter);
+			}
+		}
+
+		object->destroy();
+	}
+
+	vm.young_objects.clear();
+	reset_nursery();
+	nursery_full = false;
+
+#if DEBUG_LOG_GC
+	std::cout << "-- minor gc end\n";
+	std::cout << std::format("   promoted {} of {} young objects, heap from {} to {}\n", promoted_count, young_count, before, (std::size_t)total_heap_bytes);
+#endif
+}
+
+void Lox::compact_heap()
+{
+	using namespace MemoryImpl;
+
+	// The gray stack of an unfinished incremental cycle holds on to objects where they are now, so wait for it
+	if (phase == Phase::MARKING)
+	{
+		return;
+	}
+
+	// Young objects are promoted out of the way first, so that only references to old objects need updating
+	if (!vm.young_objects.empty())
+	{
+		collect_nursery();
+	}
+
+	compaction_pending = false;
+
+	PauseTimer timer{PauseKind::COMPACT};
+
+	// Garbage left in the pages would be moved around otherwise
+	finish_cycle();
+
+	std::vector<Page*> evacuated = select_evacuation_pages();
+	if (evacuated.empty())
+	{
+		return;
+	}
+
+#if DEBUG_LOG_GC
+	std::cout << "-- compaction begin\n";
+	std::size_t pages_before = pages.size();
+#endif
+
+	for (Page* page : evacuated)
+	{
+		page->is_retiring = true;
+	}
+	reset_free_cells(evacuated);
+
+	for (Page* page : evacuated)
+	{
+		for_each_object(page, [](Object* object) { object->promote(); });
+	}
+
+	forward_roots();
+	forward_table(vm.globals);
+	for (Object*& object : vm.remembered_objects)
+	{
+		forward_reference(object);
+	}
+	for (ObjectString*& name : vm.remembered_globals)
+	{
+		forward_reference(name);
+	}
+
+	for (Page* page : pages)
+	{
+		if (!page->is_retiring)
+		{
+			for_each_object(page, forward_references);
+		}
+	}
+
+	// All that's left in the evacuated pages are forwarding addresses
+	std::erase_if(pages, [](const Page* page) { return page->is_retiring; });
+	for (Page* page : evacuated)
+	{
+		total_heap_bytes -= count_live_cells(page) * page->cell_size;
+		for_each_object(page, [](Object* object) { object->destroy(); });
+		release_page(page);
+	}
+
+#if DEBUG_LOG_GC
+	std::cout << "-- compaction end\n";
+	std::cout << std::format("   pages from {} to {}, heap at {}\n", pages_before, pages.size(), (std::size_t)total_heap_bytes);
+#endif
+}
+
+void Lox::write_barrier(Object* holder, const Value& overwritten, const Value& value)
+{
+	// Young objects are roots of both minor collections and incremental cycles already
+	if (holder->is_young)
+	{
+		return;
+	}
+
+	if (gc_marking)
+	{
+		mark_value(overwritten);
+	}
+
+	if (!holder->is_remembered && is_object(value) && as_object(value)->is_young)
+	{
+		holder->is_remembered = true;
+		vm.remembered_objects.push_back(holder);
+	}
+}
+
+void Lox::write_barrier_global(ObjectString* name, const Value& overwritten, const Value& value)
+{
+	if (gc_marking)
+	{
+		mark_value(overwritten);
+	}
+
+	// Strings never point at other objects, so we can reuse their is_remembered flag for the global they name
+	if (!name->is_remembered && (name->is_young || (is_object(value) && as_object(value)->is_young)))
+	{
+		name->is_remembered = true;
+		vm.remembered_globals.push_back(name);
+	}
+}
+
+Lox::AllocationRegion::AllocationRegion()
+{
+#if USE_GENERATIONAL_GC
+	using namespace MemoryImpl;
+
+	if (region_depth++ == 0)
+	{
+		nursery_block_limit = std::max(NURSERY_BLOCK_COUNT, gc_policy.region_max_bytes / NURSERY_BLOCK_SIZE);
+	}
+#endif
+}
+
+Lox::AllocationRegion::~AllocationRegion()
+{
+#if USE_GENERATIONAL_GC
+	using namespace MemoryImpl;
+
+	if (--region_depth == 0)
+	{
+		// Still under the limit of the region, so that the blocks it grew the nursery by stay around for the next one
+		if (!vm.young_objects.empty())
+		{
+			collect_nursery();
+		}
+		nursery_block_limit = NURSERY_BLOCK_COUNT;
+	}
+#endif
+}
+
+Lox::HeapWriteLock::HeapWriteLock()
+	: locked(MemoryImpl::marker_running)
+{
+	if (locked)
+	{
+		MemoryImpl::heap_mutex.lock();
+	}
+}
+
+Lox::HeapWriteLock::~HeapWriteLock()
+{
+	if (locked)
+	{
+		MemoryImpl::heap_mutex.unlock();
+	}
+}
+
+void Lox::free_objects()
+{
+	using namespace MemoryImpl;
+
+	stop_marker();
+
+	for (Page* page : pages)
+	{
+		total_heap_bytes -= count_live_cells(page) * page->cell_size;
+		for_each_object(page, [](Object* object) { object->destroy(); });
+		free_page(page);
+	}
+
+	pages.clear();
+	for (void* memory : released_pages)
+	{
+		free_chunk(memory, PAGE_SIZE);
+	}
+	released_pages.clear();
+	size_classes = {};
+	sweep_cursor = 0;
+	sweep_end = 0;
+	unswept_page_count = 0;
+	phase = Phase::IDLE;
+	gc_marking = false;
+
+	for (Object* young_object : vm.young_objects)
+	{
+		young_object->destroy();
+	}
+
+	for (NurseryBlock* block : nursery.blocks)
+	{
+		free_nursery_block(block);
+	}
+
+	vm.young_objects.clear();
+	vm.remembered_objects.clear();
+	vm.remembered_globals.clear();
+	nursery = Nursery{};
 
 	vm.gray_stack.clear();
 }
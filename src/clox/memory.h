@@ -2,16 +2,24 @@
 
 #include "defines.h"
 
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <format>
 #include <iostream>
 #include <limits>
 #include <new>
+#include <string>
+#include <string_view>
 #include <variant>
+#include <vector>
 
 namespace Lox
 {
 	// Ugly forward declares because we can't include "common.h" or "value.h" as they include "memory.h" already...
 	class Object;
+	class ObjectString;
 	using f64 = double;
 	using Value = std::variant<bool, nullptr_t, f64, Object*>;
 
@@ -20,24 +28,325 @@ namespace Lox
 	void collect_garbage();
 	void free_objects();
 
+	// Called at a safepoint once the heap grew past next_gc. Without USE_INCREMENTAL_GC this is simply a
+	// full collection, otherwise it does one bounded step of the current cycle (marking, or sweeping), taking
+	// at most gc_policy.max_pause_us before handing control back to the program. With USE_CONCURRENT_GC on top of that,
+	// marking happens on a separate thread instead, and the steps just check whether it's done yet. Full collections
+	// mark and sweep on GC_WORKER_THREADS threads (or one per core if that's 0) with USE_PARALLEL_GC
+	void gc_step();
+
+	// Pause times of every collection so far, by kind and as a histogram
+	void print_gc_stats();
+
+	// One line of the heap census: How many of something are alive, and the bytes they take up including what they own
+	struct HeapCensusEntry
+	{
+		std::string name;
+		std::size_t count = 0;
+		std::size_t bytes = 0;
+	};
+
+	// Everything on the heap after a full collection, broken down by object type and container, along with
+	// instances by class, strings by length and closures by function. The allocator only counts containers by kind, so the
+	// bytes of instances by class include an estimate of their fields tables, while the "fields" container is exact.
+	// These are std:: containers and not Lox:: ones as the census shouldn't count against the heap it's describing
+	struct HeapCensus
+	{
+		std::size_t total_bytes = 0;
+		std::vector<HeapCensusEntry> objects;
+		std::vector<HeapCensusEntry> containers;
+		std::vector<HeapCensusEntry> classes;
+		std::vector<HeapCensusEntry> strings;
+		std::vector<HeapCensusEntry> closures;
+
+		// Finds an entry by its name, like "closures", "fields", "instances of Point", "strings of 8-15 chars" or
+		// "closures of <fn add>". Returns nullptr if there is no such entry, which also means there is nothing of it on the heap
+		const HeapCensusEntry* find(std::string_view name) const;
+	};
+
+	// Runs a full collection and sweeps right away, so that only live objects are left on the heap. This moves nothing,
+	// so it's safe to call from natives as well as in between scripts
+	void collect_all_garbage();
+
+	// Starts with collect_all_garbage()
+	HeapCensus take_heap_census();
+	void print_heap_census();
+
+	// Writes every object that is reachable from the roots to path as JSON, along with its type, size, references and a
+	// shortest path from the roots to it, and returns false if that didn't work out. The document looks like this:
+	//
+	//   {"format":"clox heap snapshot","version":1,"heap_bytes":1234,
+	//   "roots":[
+	//   {"kind":"global","name":"cache","to":0},
+	//   ...],
+	//   "objects":[
+	//   {"id":0,"type":"instances","size":48,"owned":96,"class":"Cache","retainer":{"root":0},"references":[{"kind":"class","to":1},...]},
+	//   ...],
+	//   "object_count":2,"reachable_bytes":1000}
+	//
+	// Roots and references both have a kind, and may have the name or the index they're stored under, like a global's name
+	// or a stack slot. Their "to" is the id of the object they point at, which is also its index in "objects". The kinds are
+	// "stack", "global", "global name", "frame", "open upvalue" and "init string" for roots, and "name", "constant",
+	// "function", "upvalue", "closed", "class", "field", "field name", "method", "method name" and "receiver" for references.
+	//
+	// Objects are listed in the order a breadth first search from the roots reaches them. The retainer of an object is either
+	// the root that reached it, or the object and the index into that object's references. Following the retainers from
+	// any object until a root gives a shortest path that keeps it alive. The type is one of the names the census uses
+	// for them as well, size is the cell the object takes up, and owned what its containers allocated besides, which is only
+	// an estimate for the tables of classes and instances, like in the census. Strings add "length" and the first few chars
+	// as "value", functions, classes and closures their "name" or "function", instances their "class", bound methods their
+	// "method" and upvalues whether they're still "open".
+	//
+	// This doesn't collect garbage first, as only reachable objects end up in the snapshot anyway. It mustn't run in the
+	// compiler, as its roots aren't part of the snapshot
+	bool write_heap_snapshot(const char* path);
+
+	// Set by SIGUSR1 with --heap-snapshot, and by collections that leave more than gc_policy.snapshot_heap_bytes alive. The VM
+	// picks this up at its next safepoint, and writes the snapshot to <heap_snapshot_prefix>.1.heap.json, .2.heap.json and so on
+	inline std::atomic<bool> heap_snapshot_requested = false;
+	inline const char* heap_snapshot_prefix = "clox";
+	void write_requested_heap_snapshot();
+
+	// Parses a comma separated list of settings like "initial_heap=8M,grow_factor=1.5" into gc_policy, see GcPolicy for the
+	// keys. Sizes take K, M and G suffixes. Complains about anything it doesn't understand on stderr, and returns false then
+	bool configure_gc(const char* settings);
+
+	// For embedding hosts with time to spare between calls to interpret(): Lets the collector work for up to budget_us,
+	// on the cycle that's already running, or on a new one if the heap grew at least halfway to next_gc since the last one.
+	// This also runs a minor collection and any pending compaction, as nothing holds on to objects in between scripts
+	void collect_garbage_idle(f64 budget_us);
+
+	// For embedding hosts that handle one request per call to interpret(), where nearly everything the call allocates is
+	// garbage once it returns. While a region exists, the nursery grows up to gc_policy.region_max_bytes instead of being
+	// collected every GC_NURSERY_SIZE, so that the temporaries of the request aren't promoted just because they happened
+	// to be alive at the time. The end of the region runs a minor collection, which moves whatever the globals still
+	// reference into the old space and resets the whole nursery in one go, so it only costs as much as what survives.
+	// The grown nursery is kept for the next region, until a minor collection outside of one shrinks it again. It never
+	// grows past what gc_policy.heap_limit_bytes leaves room for, and is emptied out before the limit fails a script.
+	//
+	// Like collect_garbage_idle(), regions must only begin and end in between calls to interpret(). They can be nested,
+	// in which case the outermost one does all the work. Without USE_GENERATIONAL_GC they do nothing
+	class AllocationRegion
+	{
+	public:
+		AllocationRegion();
+		AllocationRegion(const AllocationRegion&) = delete;
+		AllocationRegion& operator=(const AllocationRegion&) = delete;
+		~AllocationRegion();
+	};
+
+	// Old objects live in GC_PAGE_SIZE pages, each of which is carved up into cells of a single size class. allocate_old() only
+	// hands out a cell, and the object constructed in there becomes part of the heap once it's passed to add_old_object()
+	void* allocate_old(std::size_t size);
+	void add_old_object(Object* object);
+
+	// New objects are bump allocated in the nursery, and the ones that survive a minor collection are moved
+	// into the old space. As that moves objects around, collect_nursery() must only run at VM safepoints,
+	// where no C++ code holds on to object pointers: Allocation merely sets nursery_full once it runs out of room
+	void* allocate_young(std::size_t size);
+	void collect_nursery();
+
+	// Objects allocated while this is set skip the nursery and go straight into the old space. Loading a heap image sets it,
+	// as everything in there lives as long as the program does, and promoting all of it would only copy it once more
+	inline bool pretenure_objects = false;
+
+	// With USE_COMPACTING_GC, collections that leave many pages less than GC_COMPACT_THRESHOLD percent full set
+	// compaction_pending. The next safepoint then moves the objects of those pages into the other pages of their size
+	// class, and frees the emptied ones, so that a heap that shrank after a peak doesn't stay spread over all its pages
+	void compact_heap();
+
+	// Must be called before storing value inside holder over the overwritten one (or inside the globals table for
+	// write_barrier_global), so that minor collections can find old objects pointing at young ones without scanning
+	// the whole old space. While incremental marking is running, this also shades the overwritten value: Everything
+	// that was reachable when the cycle started survives it, so the program can't hide objects from the marker
+	void write_barrier(Object* holder, const Value& overwritten, const Value& value);
+	void write_barrier_global(ObjectString* name, const Value& overwritten, const Value& value);
+
+	// Anything that changes the references held by an existing object, or calls write_barrier(), must hold one of these.
+	// It does nothing unless the marker thread of USE_CONCURRENT_GC is running, in which case it keeps that out of the way
+	class HeapWriteLock
+	{
+	public:
+		HeapWriteLock();
+		HeapWriteLock(const HeapWriteLock&) = delete;
+		HeapWriteLock& operator=(const HeapWriteLock&) = delete;
+		~HeapWriteLock();
+
+	private:
+		bool locked;
+	};
+
+#if USE_COMPRESSED_POINTERS
+	// Every object lives in a single 4GB reservation starting here, the heap cage, so that references between objects fit
+	// into 32 bits. Nothing is ever placed at the very start of the cage, which leaves offset zero free to mean nullptr
+	inline char* heap_cage_base = nullptr;
+
+	// Reference to an object of type T that is stored as its offset into the heap cage, and otherwise behaves like a T*
+	template<typename T>
+	class ObjectRef
+	{
+	public:
+		ObjectRef() = default;
+
+		ObjectRef(T* object)
+			: offset(compress(object))
+		{
+		}
+
+		ObjectRef& operator=(T* object)
+		{
+			offset = compress(object);
+			return *this;
+		}
+
+		operator T*() const
+		{
+			return offset != 0 ? reinterpret_cast<T*>(heap_cage_base + offset) : nullptr;
+		}
+
+		T* operator->() const
+		{
+			return *this;
+		}
+
+	private:
+		std::uint32_t offset = 0;
+
+		static std::uint32_t compress(T* object)
+		{
+			return object != nullptr ? (std::uint32_t)(reinterpret_cast<char*>(object) - heap_cage_base) : 0;
+		}
+	};
+#else
+	template<typename T>
+	using ObjectRef = T*;
+#endif
+
+#if USE_PARALLEL_GC
+	inline std::atomic<std::size_t> total_heap_bytes = 0;	 // Parallel sweeping frees objects from several threads at once
+#else
 	inline std::size_t total_heap_bytes = 0;
-	inline std::size_t next_gc = 1024 * 1024;
+#endif
+	// Tunables of the collector. These start out with the values from defines.h, and can be changed at startup
+	// through configure_gc(), with the keys given next to each of them
+	struct GcPolicy
+	{
+		std::size_t initial_heap_bytes = GC_INITIAL_HEAP_SIZE;	  // initial_heap: Where the first collection starts
+		f64 heap_grow_factor = GC_HEAP_GROW_FACTOR;	   // grow_factor: How far the heap may grow past what survived a collection
+		std::size_t min_heap_bytes = GC_MIN_HEAP_SIZE;	  // min_heap: Collections never start below this
+		std::size_t max_heap_bytes = GC_MAX_HEAP_SIZE;	  // max_heap: Collections get more frequent instead of growing past this, 0 for none
+		std::size_t heap_limit_bytes = GC_HEAP_LIMIT;	 // heap_limit: Scripts that need more than this fail with a runtime error, 0 for none
+		std::size_t snapshot_heap_bytes = GC_SNAPSHOT_HEAP_SIZE;	// snapshot_at: Ask for a heap snapshot once a collection leaves this much alive, 0 for never
+		bool use_pacer = GC_PACER;	  // pacer: Start incremental cycles early, by how much the program allocated during the last one
+		std::size_t step_bytes = GC_INCREMENTAL_STEP_BYTES;	   // step_bytes: Allocation between incremental steps
+		f64 max_pause_us = GC_MAX_PAUSE_US;	   // max_pause_us: Time budget of an incremental step
+		std::size_t retained_empty_pages = GC_RETAINED_EMPTY_PAGES;	   // retained_pages: Empty pages kept instead of released
+		std::size_t region_max_bytes = GC_REGION_MAX_SIZE;	  // region_max: How far the nursery may grow inside an AllocationRegion
+		bool stress = DEBUG_STRESS_GC;	  // stress: Collect on every allocation and safepoint
+	};
+
+	inline GcPolicy gc_policy;
+
+	inline std::size_t next_gc = GC_INITIAL_HEAP_SIZE;
+	inline std::size_t allocated_bytes = 0;	   // Only ever grows, so that the pacer can tell how much the program allocated
+	inline bool nursery_full = false;
+	inline bool compaction_pending = false;
+	inline bool gc_marking = false;	   // An incremental cycle is between its first and last marking step
+	inline bool gc_requested = false;	 // Set by the allocator, and picked up by the next maybe_collect_garbage()
+
+	// What the memory that containers allocate through TrackingAllocator is used for. Together with the object cells and
+	// the nursery, these make up total_heap_bytes, so the census can account for every byte of it
+	enum class HeapUse : unsigned char
+	{
+		STRINGS,	// Characters of Lox::String that don't fit into the string itself
+		CHUNKS,	   // Bytecode, line numbers and constants of functions
+		UPVALUE_ARRAYS,
+		STRING_TABLE,	 // vm.strings, including the copies of the interned strings it uses as keys
+		GLOBALS,
+		METHODS,
+		FIELDS,
+		COUNT
+	};
+
+	constexpr const char* HEAP_USE_NAMES[] = {"string chars", "chunks", "upvalue arrays", "string table", "globals", "methods", "fields"};
+
+#if USE_PARALLEL_GC
+	inline std::array<std::atomic<std::size_t>, (std::size_t)HeapUse::COUNT> heap_use_bytes{};
+#else
+	inline std::array<std::size_t, (std::size_t)HeapUse::COUNT> heap_use_bytes{};
+#endif
+
+	// Thrown by maybe_collect_garbage() when the heap is past gc_policy.heap_limit_bytes even after a full collection.
+	// interpret() and compile() catch this and report it as an error of the script, so it never reaches the host
+	struct HeapLimitExceeded : std::bad_alloc
+	{
+		const char* what() const noexcept override
+		{
+			return "Lox heap limit exceeded";
+		}
+	};
+
+	// Runs the collection that the allocator asked for, and enforces the heap limit
+	void collect_requested_garbage();
+
+	// Called by the allocator before the heap grows by another bytes. Collecting right here could catch the caller halfway
+	// through growing a chunk or rehashing a table, so this only asks for a collection at the next maybe_collect_garbage()
+	inline void request_gc(std::size_t bytes)
+	{
+		if (total_heap_bytes + bytes > next_gc || gc_policy.stress)
+		{
+			gc_requested = true;
+		}
+	}
+
+	// Counts down the bytes until the allocation profiler takes its next sample, see alloc_profiler.h. While the profiler
+	// is off this never gets anywhere near zero, so that allocating only pays for the subtraction
+	inline std::ptrdiff_t bytes_until_allocation_sample = PTRDIFF_MAX;
+
+	void take_allocation_sample(Object* object, std::size_t bytes, const char* kind);
+
+	// Called for every object and container allocation, with the object if there is one so that we can follow it until it dies
+	inline void count_allocation(Object* object, std::size_t bytes, const char* kind)
+	{
+		bytes_until_allocation_sample -= (std::ptrdiff_t)bytes;
+		if (bytes_until_allocation_sample < 0)
+		{
+			take_allocation_sample(object, bytes, kind);
+		}
+	}
+
+	// The safepoints of the collector: This must only be called where every live object is reachable from the roots, which is
+	// in between instructions for the VM, and in between declarations for the compiler
+	inline void maybe_collect_garbage()
+	{
+		if (gc_requested)
+		{
+			collect_requested_garbage();
+		}
+	}
 
 	// We'll use types like Lox::Vec and Lox::String instead of std::vector and std::string
 	// to track our total memory usage in order to decide when to run the Lox garbage collector.
 	// Those types will use instances of this allocator, which tracks total memory usage by
 	// reading/writing to total_heap_bytes.
 	//
-	// This is mostly taken from the example at https://en.cppreference.com/w/cpp/named_req/Allocator
-	template<class T>
+	// This is mostly taken from the example at https://en.cppreference.com/w/cpp/named_req/Allocator.
+	// USE says what the container is for, and is carried over to the node and bucket allocations of maps
+	template<class T, HeapUse USE>
 	struct TrackingAllocator
 	{
 		typedef T value_type;
 
+		template<class U>
+		struct rebind
+		{
+			using other = TrackingAllocator<U, USE>;
+		};
+
 		TrackingAllocator() = default;
 
 		template<class U>
-		constexpr TrackingAllocator(const TrackingAllocator<U>&) noexcept
+		constexpr TrackingAllocator(const TrackingAllocator<U, USE>&) noexcept
 		{
 		}
 
@@ -48,14 +357,14 @@ namespace Lox
 				throw std::bad_array_new_length();
 			}
 
-			if (total_heap_bytes > next_gc || DEBUG_STRESS_GC)
-			{
-				collect_garbage();
-			}
+			request_gc(n * sizeof(T));
 
 			if (auto p = static_cast<T*>(std::malloc(n * sizeof(T))))
 			{
 				total_heap_bytes += n * sizeof(T);
+				heap_use_bytes[(std::size_t)USE] += n * sizeof(T);
+				allocated_bytes += n * sizeof(T);
+				count_allocation(nullptr, n * sizeof(T), HEAP_USE_NAMES[(std::size_t)USE]);
 #if DEBUG_LOG_GC
 				report(p, n);
 #endif
@@ -68,6 +377,7 @@ namespace Lox
 		void deallocate(T* p, std::size_t n) noexcept
 		{
 			total_heap_bytes -= n * sizeof(T);
+			heap_use_bytes[(std::size_t)USE] -= n * sizeof(T);
 #if DEBUG_LOG_GC
 			report(p, n, 0);
 #endif
@@ -1,4 +1,5 @@
 #include "object.h"
+#include "alloc_profiler.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -7,29 +8,206 @@
 
 namespace ObjectImpl
 {
-	static Lox::TrackingAllocator<u8> allocator;
-
 	template<typename T, typename... Args>
 	T* allocate(Args&&... args)
 	{
-		u8* buf = allocator.allocate(sizeof(T));
-		T* object = new (buf) T(std::forward<Args>(args)...);
+		T* object;
+#if USE_GENERATIONAL_GC
+		if (!Lox::pretenure_objects)
+		{
+			object = new (Lox::allocate_young(sizeof(T))) T(std::forward<Args>(args)...);
+			object->is_young = true;
+			Lox::vm.young_objects.push_back(object);
+		}
+		else
+#endif
+		{
+			object = new (Lox::allocate_old(sizeof(T))) T(std::forward<Args>(args)...);
+			Lox::add_old_object(object);
+		}
+
+		Lox::count_allocation(object, sizeof(T), Lox::OBJECT_TYPE_NAMES[(std::size_t)T::TYPE]);
+		return object;
+	}
 
-		object->next = Lox::vm.objects;
-		Lox::vm.objects = object;
+	// Moves the contents of an object into a fresh old one, which either promotes a young object or evacuates an old one
+	// out of a page that's being compacted. All that's left behind is an ObjectForwarded pointing at the new location, for
+	// the rest of the collection to find
+	template<typename T>
+	T* promote(T* from)
+	{
+		static_assert(sizeof(T) >= sizeof(Lox::ObjectForwarded), "Every object must have room for its forwarding address");
 
+		bool was_young = from->is_young;
+
+		// Old objects stay in the remembered set, while the minor collection promoting a young one empties it anyway
+		T* object = new (Lox::allocate_old(sizeof(T))) T(std::move(*from));
+		object->is_young = false;
+		object->is_remembered = !was_young && from->is_remembered;
+		Lox::add_old_object(object);
+
+		if (from->is_sampled)
+		{
+			Lox::move_allocation_sample(from, object);
+		}
+
+		from->~T();
+		Lox::ObjectForwarded* forwarded = new (from) Lox::ObjectForwarded(object);
+		forwarded->is_young = was_young;
 		return object;
 	}
+}
 
-	template<typename T>
-	void free(void* ptr)
+Lox::Object::Object(ObjectType in_type)
+	: type(in_type)
+{
+}
+
+Lox::Object* Lox::Object::promote()
+{
+	switch (type)
 	{
-		allocator.deallocate(static_cast<unsigned char*>(ptr), sizeof(T));
+		case ObjectType::STRING:
+		{
+			return static_cast<ObjectString*>(this)->promote();
+		}
+		case ObjectType::FUNCTION:
+		{
+			return static_cast<ObjectFunction*>(this)->promote();
+		}
+		case ObjectType::UPVALUE:
+		{
+			return static_cast<ObjectUpvalue*>(this)->promote();
+		}
+		case ObjectType::CLOSURE:
+		{
+			return static_cast<ObjectClosure*>(this)->promote();
+		}
+		case ObjectType::NATIVE_FUNCTION:
+		{
+			return static_cast<ObjectNativeFunction*>(this)->promote();
+		}
+		case ObjectType::CLASS:
+		{
+			return static_cast<ObjectClass*>(this)->promote();
+		}
+		case ObjectType::INSTANCE:
+		{
+			return static_cast<ObjectInstance*>(this)->promote();
+		}
+		case ObjectType::BOUND_METHOD:
+		{
+			return static_cast<ObjectBoundMethod*>(this)->promote();
+		}
+		case ObjectType::FORWARDED:
+		{
+			return static_cast<ObjectForwarded*>(this)->promote();
+		}
+	}
+
+	assert(false);
+	return nullptr;
+}
+
+void Lox::Object::destroy()
+{
+	if (is_sampled)
+	{
+		forget_allocation_sample(this);
+	}
+
+	switch (type)
+	{
+		case ObjectType::STRING:
+		{
+			static_cast<ObjectString*>(this)->~ObjectString();
+			return;
+		}
+		case ObjectType::FUNCTION:
+		{
+			static_cast<ObjectFunction*>(this)->~ObjectFunction();
+			return;
+		}
+		case ObjectType::UPVALUE:
+		{
+			static_cast<ObjectUpvalue*>(this)->~ObjectUpvalue();
+			return;
+		}
+		case ObjectType::CLOSURE:
+		{
+			static_cast<ObjectClosure*>(this)->~ObjectClosure();
+			return;
+		}
+		case ObjectType::NATIVE_FUNCTION:
+		{
+			static_cast<ObjectNativeFunction*>(this)->~ObjectNativeFunction();
+			return;
+		}
+		case ObjectType::CLASS:
+		{
+			static_cast<ObjectClass*>(this)->~ObjectClass();
+			return;
+		}
+		case ObjectType::INSTANCE:
+		{
+			static_cast<ObjectInstance*>(this)->~ObjectInstance();
+			return;
+		}
+		case ObjectType::BOUND_METHOD:
+		{
+			static_cast<ObjectBoundMethod*>(this)->~ObjectBoundMethod();
+			return;
+		}
+		case ObjectType::FORWARDED:
+		{
+			static_cast<ObjectForwarded*>(this)->~ObjectForwarded();
+			return;
+		}
 	}
 }
 
 Lox::String Lox::Object::to_string() const
 {
+	switch (type)
+	{
+		case ObjectType::STRING:
+		{
+			return static_cast<const ObjectString*>(this)->to_string();
+		}
+		case ObjectType::FUNCTION:
+		{
+			return static_cast<const ObjectFunction*>(this)->to_string();
+		}
+		case ObjectType::UPVALUE:
+		{
+			return static_cast<const ObjectUpvalue*>(this)->to_string();
+		}
+		case ObjectType::CLOSURE:
+		{
+			return static_cast<const ObjectClosure*>(this)->to_string();
+		}
+		case ObjectType::NATIVE_FUNCTION:
+		{
+			return static_cast<const ObjectNativeFunction*>(this)->to_string();
+		}
+		case ObjectType::CLASS:
+		{
+			return static_cast<const ObjectClass*>(this)->to_string();
+		}
+		case ObjectType::INSTANCE:
+		{
+			return static_cast<const ObjectInstance*>(this)->to_string();
+		}
+		case ObjectType::BOUND_METHOD:
+		{
+			return static_cast<const ObjectBoundMethod*>(this)->to_string();
+		}
+		case ObjectType::FORWARDED:
+		{
+			return "";
+		}
+	}
+
 	return "";
 }
 
@@ -38,38 +216,39 @@ Lox::ObjectString* Lox::ObjectString::allocate(const Lox::String& string)
 	auto iter = vm.strings.find(string);
 	if (iter != vm.strings.end())
 	{
+		// The interned string table is weak, so an incremental cycle might have already decided this one is garbage
+		if (gc_marking)
+		{
+			HeapWriteLock lock;
+			mark_object(iter->second);
+		}
 		return iter->second;
 	}
 
 	Lox::ObjectString* instance = ObjectImpl::allocate<Lox::ObjectString>(string);
-
-	// Make sure instance is marked as a root if we trigger GC on the insert call below it.
-	// Here we don't *need* to do this because vm.strings is not tracked by GC (although it should...)
-	push(instance);
 	vm.strings.insert({string, instance});
-	pop();
-
 	return instance;
 }
 
-void Lox::ObjectString::free(ObjectString* instance)
-{
-	ObjectImpl::free<Lox::ObjectString>(instance);
-}
-
 Lox::ObjectString::ObjectString(const Lox::String& in_string)
-	: string(in_string)
+	: Object(TYPE)
+	, string(in_string)
 {
 }
 
-Lox::ObjectString::~ObjectString()
+Lox::Object* Lox::ObjectString::promote()
 {
-	vm.strings.erase(string);
-}
+	// The interned string table is weak, so it doesn't get updated along with the other references
+	auto iter = vm.strings.find(string);
+	bool is_interned = iter != vm.strings.end() && iter->second == this;
 
-void Lox::ObjectString::free()
-{
-	Lox::ObjectString::free(this);
+	ObjectString* promoted = ObjectImpl::promote(this);
+	if (is_interned)
+	{
+		iter->second = promoted;
+	}
+
+	return promoted;
 }
 
 Lox::String Lox::ObjectString::to_string() const
@@ -87,18 +266,19 @@ Lox::ObjectFunction* Lox::ObjectFunction::allocate()
 	Lox::ObjectFunction* instance = ObjectImpl::allocate<Lox::ObjectFunction>();
 	instance->arity = 0;
 	instance->upvalue_count = 0;
+	instance->max_slots = 0;
 	instance->name = nullptr;
 	return instance;
 }
 
-void Lox::ObjectFunction::free(ObjectFunction* instance)
+Lox::ObjectFunction::ObjectFunction()
+	: Object(TYPE)
 {
-	ObjectImpl::free<Lox::ObjectFunction>(instance);
 }
 
-void Lox::ObjectFunction::free()
+Lox::Object* Lox::ObjectFunction::promote()
 {
-	Lox::ObjectFunction::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectFunction::to_string() const
@@ -115,19 +295,24 @@ Lox::ObjectUpvalue* Lox::ObjectUpvalue::allocate(Value* slot)
 	return instance;
 }
 
-void Lox::ObjectUpvalue::free(ObjectUpvalue* instance)
-{
-	ObjectImpl::free<Lox::ObjectUpvalue>(instance);
-}
-
 Lox::ObjectUpvalue::ObjectUpvalue(Value* in_slot)
-	: location(in_slot)
+	: Object(TYPE)
+	, location(in_slot)
 {
 }
 
-void Lox::ObjectUpvalue::free()
+Lox::Object* Lox::ObjectUpvalue::promote()
 {
-	Lox::ObjectUpvalue::free(this);
+	// Closed upvalues point at their own value
+	bool is_closed = location == &closed;
+
+	ObjectUpvalue* promoted = ObjectImpl::promote(this);
+	if (is_closed)
+	{
+		promoted->location = &promoted->closed;
+	}
+
+	return promoted;
 }
 
 Lox::String Lox::ObjectUpvalue::to_string() const
@@ -138,24 +323,20 @@ Lox::String Lox::ObjectUpvalue::to_string() const
 Lox::ObjectClosure* Lox::ObjectClosure::allocate(ObjectFunction* function)
 {
 	Lox::ObjectClosure* instance = ObjectImpl::allocate<Lox::ObjectClosure>(function);
-	instance->function = function;
-	instance->upvalues.reserve(function->upvalue_count);
 	return instance;
 }
 
-void Lox::ObjectClosure::free(ObjectClosure* instance)
-{
-	ObjectImpl::free<Lox::ObjectClosure>(instance);
-}
-
 Lox::ObjectClosure::ObjectClosure(ObjectFunction* in_function)
-	: function(in_function)
+	: Object(TYPE)
+	, function(in_function)
 {
+	// Reserving may start a collection, which must not find the closure yet as nothing references it
+	upvalues.reserve(function->upvalue_count);
 }
 
-void Lox::ObjectClosure::free()
+Lox::Object* Lox::ObjectClosure::promote()
 {
-	Lox::ObjectClosure::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectClosure::to_string() const
@@ -169,19 +350,15 @@ Lox::ObjectNativeFunction* Lox::ObjectNativeFunction::allocate(NativeFn in_funct
 	return instance;
 }
 
-void Lox::ObjectNativeFunction::free(ObjectNativeFunction* instance)
-{
-	ObjectImpl::free<Lox::ObjectNativeFunction>(instance);
-}
-
 Lox::ObjectNativeFunction::ObjectNativeFunction(NativeFn in_function)
-	: function(in_function)
+	: Object(TYPE)
+	, function(in_function)
 {
 }
 
-void Lox::ObjectNativeFunction::free()
+Lox::Object* Lox::ObjectNativeFunction::promote()
 {
-	Lox::ObjectNativeFunction::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectNativeFunction::to_string() const
@@ -195,19 +372,15 @@ Lox::ObjectClass* Lox::ObjectClass::allocate(Lox::ObjectString* in_name)
 	return cls;
 }
 
-void Lox::ObjectClass::free(ObjectClass* instance)
-{
-	ObjectImpl::free<Lox::ObjectClass>(instance);
-}
-
 Lox::ObjectClass::ObjectClass(ObjectString* in_name)
-	: name(in_name)
+	: Object(TYPE)
+	, name(in_name)
 {
 }
 
-void Lox::ObjectClass::free()
+Lox::Object* Lox::ObjectClass::promote()
 {
-	Lox::ObjectClass::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectClass::to_string() const
@@ -221,19 +394,15 @@ Lox::ObjectInstance* Lox::ObjectInstance::allocate(ObjectClass* klass)
 	return instance;
 }
 
-void Lox::ObjectInstance::free(ObjectInstance* instance)
-{
-	ObjectImpl::free<Lox::ObjectInstance>(instance);
-}
-
 Lox::ObjectInstance::ObjectInstance(Lox::ObjectClass* in_klass)
-	: klass(in_klass)
+	: Object(TYPE)
+	, klass(in_klass)
 {
 }
 
-void Lox::ObjectInstance::free()
+Lox::Object* Lox::ObjectInstance::promote()
 {
-	Lox::ObjectInstance::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectInstance::to_string() const
@@ -247,23 +416,30 @@ Lox::ObjectBoundMethod* Lox::ObjectBoundMethod::allocate(Value receiver, ObjectC
 	return bound;
 }
 
-void Lox::ObjectBoundMethod::free(ObjectBoundMethod* instance)
-{
-	ObjectImpl::free<ObjectBoundMethod>(instance);
-}
-
 Lox::ObjectBoundMethod::ObjectBoundMethod(Value in_receiver, ObjectClosure* in_method)
-	: receiver(in_receiver)
+	: Object(TYPE)
 	, method(in_method)
+	, receiver(in_receiver)
 {
 }
 
-void Lox::ObjectBoundMethod::free()
+Lox::Object* Lox::ObjectBoundMethod::promote()
 {
-	Lox::ObjectBoundMethod::free(this);
+	return ObjectImpl::promote(this);
 }
 
 Lox::String Lox::ObjectBoundMethod::to_string() const
 {
 	return method->function->to_string();
 }
+
+Lox::ObjectForwarded::ObjectForwarded(Object* in_destination)
+	: Object(TYPE)
+	, destination(in_destination)
+{
+}
+
+Lox::Object* Lox::ObjectForwarded::promote()
+{
+	return destination;
+}
@@ -7,31 +7,64 @@
 
 namespace Lox
 {
+	enum class ObjectType : u8
+	{
+		STRING,
+		FUNCTION,
+		UPVALUE,
+		CLOSURE,
+		NATIVE_FUNCTION,
+		CLASS,
+		INSTANCE,
+		BOUND_METHOD,
+		FORWARDED	 // Object that was already moved, and is now an ObjectForwarded
+	};
+
+	constexpr const char* OBJECT_TYPE_NAMES[] = {"strings", "functions", "upvalues", "closures", "natives", "classes", "instances", "bound methods"};
+
+	// Objects don't have a vtable: The few operations that differ between types switch on the type tag instead, which
+	// leaves a header of a single word, as the mark bits live in the bitmaps of the heap.
+	//
+	// References to other objects are ObjectRefs, which only take 32 bits with USE_COMPRESSED_POINTERS. Subclasses
+	// declare one of them first where they can, so that it fills the rest of the header word instead of adding another
 	class Object
 	{
 	public:
-		bool is_marked = false;
-		Object* next = nullptr;
+		const ObjectType type;
+		bool is_young = false;		  // Lives in the nursery, and will be moved by the next minor collection if it survives
+		bool is_remembered = false;	  // Old object that is in vm.remembered_objects, as it may point at young objects
+		bool is_sampled = false;	// Picked by the allocation profiler, which wants to know when it dies
 
 	public:
-		virtual ~Object(){};
-		virtual void free() = 0;	// So that we can free an instance polymorphically, likely a bad idea...
-		virtual Lox::String to_string() const;
+		Object* promote();	  // Moves the object into a fresh old cell, returning its new location
+		void destroy();	   // Runs the destructor of the actual type, without giving back the memory
+		Lox::String to_string() const;
+
+	protected:
+		explicit Object(ObjectType in_type);
+		~Object() = default;
 	};
 
+	// Replaces dynamic_cast for objects, returning nullptr if the object isn't a T
+	template<typename T>
+	T* object_cast(Object* object)
+	{
+		return object != nullptr && object->type == T::TYPE ? static_cast<T*>(object) : nullptr;
+	}
+
 	class ObjectString : public Object
 	{
 	public:
+		static constexpr ObjectType TYPE = ObjectType::STRING;
+
 		// Custom allocation as these are garbage collected/interned.
 		// There is likely a cleaner way of doing this...
 		static ObjectString* allocate(const Lox::String& string);
-		static void free(ObjectString* instance);
 
 		ObjectString(const Lox::String& string);
-		virtual ~ObjectString() override;
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 		const Lox::String& get_string() const;
 
 	private:
@@ -41,114 +74,137 @@ namespace Lox
 	class ObjectFunction : public Object
 	{
 	public:
+		static constexpr ObjectType TYPE = ObjectType::FUNCTION;
+
+		ObjectRef<ObjectString> name;
 		i32 arity = 0;
 		i32 upvalue_count = 0;
+		i32 max_slots = 0;	  // Most stack slots a call can use at once, counting slot zero and the parameters
 		Chunk chunk;
-		ObjectString* name;
 
 	public:
 		static ObjectFunction* allocate();
-		static void free(ObjectFunction* instance);
 
-		virtual void free() override;
+		ObjectFunction();
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	class ObjectUpvalue : public Object
 	{
 	public:
+		static constexpr ObjectType TYPE = ObjectType::UPVALUE;
+
+		ObjectRef<ObjectUpvalue> next_upvalue = nullptr;
 		Value* location = nullptr;
 		Value closed;
-		ObjectUpvalue* next_upvalue = nullptr;
 
 	public:
 		static ObjectUpvalue* allocate(Value* slot);
-		static void free(ObjectUpvalue* instance);
 
 		ObjectUpvalue(Value* slot);
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	class ObjectClosure : public Object
 	{
 	public:
-		ObjectFunction* function;
-		Lox::Vec<ObjectUpvalue*> upvalues;
+		static constexpr ObjectType TYPE = ObjectType::CLOSURE;
+
+		ObjectRef<ObjectFunction> function;
+		Lox::Vec<ObjectRef<ObjectUpvalue>, HeapUse::UPVALUE_ARRAYS> upvalues;
 
 	public:
 		static ObjectClosure* allocate(ObjectFunction* function);
-		static void free(ObjectClosure* instance);
 
 		ObjectClosure(ObjectFunction* function);
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	using NativeFn = Value (*)(i32 arg_count, Value* args);
 	class ObjectNativeFunction : public Object
 	{
 	public:
+		static constexpr ObjectType TYPE = ObjectType::NATIVE_FUNCTION;
+
 		NativeFn function;
 
 	public:
 		static ObjectNativeFunction* allocate(NativeFn function);
-		static void free(ObjectNativeFunction* instance);
 
 		ObjectNativeFunction(NativeFn function);
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	class ObjectClass : public Object
 	{
 	public:
-		ObjectString* name;
-		std::unordered_map<Lox::ObjectString*, Lox::Value> methods;
+		static constexpr ObjectType TYPE = ObjectType::CLASS;
+
+		ObjectRef<ObjectString> name;
+		Lox::Map<Lox::ObjectString*, Lox::Value, HeapUse::METHODS> methods;
 
 	public:
 		static ObjectClass* allocate(ObjectString* name);
-		static void free(ObjectClass* instance);
 
 		ObjectClass(ObjectString* name);
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	class ObjectInstance : public Object
 	{
 	public:
-		ObjectClass* klass;
-		std::unordered_map<Lox::ObjectString*, Lox::Value> fields;
+		static constexpr ObjectType TYPE = ObjectType::INSTANCE;
+
+		ObjectRef<ObjectClass> klass;
+		Lox::Map<Lox::ObjectString*, Lox::Value, HeapUse::FIELDS> fields;
 
 	public:
 		static ObjectInstance* allocate(ObjectClass* klass);
-		static void free(ObjectInstance* instance);
 
 		ObjectInstance(ObjectClass* klass);
-		virtual void free() override;
+		Object* promote();
 
-		virtual Lox::String to_string() const override;
+		Lox::String to_string() const;
 	};
 
 	class ObjectBoundMethod : public Object
 	{
 	public:
+		static constexpr ObjectType TYPE = ObjectType::BOUND_METHOD;
+
+		ObjectRef<ObjectClosure> method;
 		Value receiver;
-		ObjectClosure* method;
 
 	public:
 		static ObjectBoundMethod* allocate(Value receiver, ObjectClosure* method);
-		static void free(ObjectBoundMethod* instance);
 
 		ObjectBoundMethod(Value receiver, ObjectClosure* method);
-		virtual void free() override;
+		Object* promote();
+
+		Lox::String to_string() const;
+	};
 
-		virtual Lox::String to_string() const override;
+	// What's left of an object once a minor collection moved it into the old space, or a compaction moved it out of
+	// a sparse page, so that the rest of that collection can find out where it went
+	class ObjectForwarded : public Object
+	{
+	public:
+		static constexpr ObjectType TYPE = ObjectType::FORWARDED;
+
+		Object* destination;
+
+	public:
+		ObjectForwarded(Object* destination);
+		Object* promote();
 	};
 }	 // namespace Lox
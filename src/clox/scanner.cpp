@@ -1,7 +1,17 @@
 #include "scanner.h"
 
+#include <array>
+#include <bit>
+#include <cstring>
 #include <string>
 
+#if USE_SIMD_SCANNER && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SCANNER_SSE2 1
+#include <emmintrin.h>
+#else
+#define SCANNER_SSE2 0
+#endif
+
 namespace ScannerImpl
 {
 	struct Scanner
@@ -55,6 +65,171 @@ namespace ScannerImpl
 		return scanner.current[1];
 	}
 
+	bool is_blank(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	bool is_identifier_character(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+
+	bool is_string_character(char c)
+	{
+		return c != '"' && c != '\n' && c != '\0';
+	}
+
+	bool is_comment_character(char c)
+	{
+		return c != '\n' && c != '\0';
+	}
+
+#if SCANNER_SSE2
+	// Most runs of blanks and identifier characters are just a handful of bytes long, so we check that many
+	// characters one at a time before paying for the SIMD setup
+	constexpr i32 SCALAR_PREFIX_LENGTH = 8;
+
+	// Returns the first character at or after 'from' whose byte is set in the mask produced by 'stop', which
+	// receives 16 characters at a time. We only ever do aligned loads: Those can read a few bytes before 'from'
+	// (which we mask away) or after the null terminator, but never cross into the next page, so they can't fault.
+	// Every 'stop' predicate below includes the terminator, so we never go past the block that contains it
+	template<typename StopFn>
+	const char* find_first(const char* from, StopFn stop)
+	{
+		const std::uintptr_t misalignment = reinterpret_cast<std::uintptr_t>(from) & 15;
+		const char* block = from - misalignment;
+
+		u32 mask = (u32)_mm_movemask_epi8(stop(_mm_load_si128(reinterpret_cast<const __m128i*>(block)))) & (0xFFFFu << misalignment);
+		while (mask == 0)
+		{
+			block += 16;
+			mask = (u32)_mm_movemask_epi8(stop(_mm_load_si128(reinterpret_cast<const __m128i*>(block))));
+		}
+
+		return block + std::countr_zero(mask);
+	}
+#endif
+
+	// Skips spaces, tabs and carriage returns, but not newlines as those need to bump the line count
+	const char* skip_blanks(const char* from)
+	{
+#if SCANNER_SSE2
+		for (i32 index = 0; index < SCALAR_PREFIX_LENGTH; ++index, ++from)
+		{
+			if (!is_blank(*from))
+			{
+				return from;
+			}
+		}
+
+		return find_first(
+			from,
+			[](__m128i chars)
+			{
+				__m128i blank = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t'))),
+					_mm_cmpeq_epi8(chars, _mm_set1_epi8('\r'))
+				);
+				return _mm_cmpeq_epi8(blank, _mm_setzero_si128());
+			}
+		);
+#else
+		while (is_blank(*from))
+		{
+			from++;
+		}
+		return from;
+#endif
+	}
+
+	// Finds the newline (or the end of the source) that terminates a line comment
+	const char* skip_to_line_end(const char* from)
+	{
+#if SCANNER_SSE2
+		return find_first(
+			from,
+			[](__m128i chars)
+			{
+				return _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+			}
+		);
+#else
+		while (is_comment_character(*from))
+		{
+			from++;
+		}
+		return from;
+#endif
+	}
+
+	// Finds the next character inside a string literal that needs attention: The closing quote, a newline, or the end of the source
+	const char* skip_string_characters(const char* from)
+	{
+#if SCANNER_SSE2
+		for (i32 index = 0; index < SCALAR_PREFIX_LENGTH; ++index, ++from)
+		{
+			if (!is_string_character(*from))
+			{
+				return from;
+			}
+		}
+
+		return find_first(
+			from,
+			[](__m128i chars)
+			{
+				return _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('"')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'))),
+					_mm_cmpeq_epi8(chars, _mm_setzero_si128())
+				);
+			}
+		);
+#else
+		while (is_string_character(*from))
+		{
+			from++;
+		}
+		return from;
+#endif
+	}
+
+	// Skips the rest of an identifier, i.e. [a-zA-Z0-9_]*
+	const char* skip_identifier_characters(const char* from)
+	{
+#if SCANNER_SSE2
+		for (i32 index = 0; index < SCALAR_PREFIX_LENGTH; ++index, ++from)
+		{
+			if (!is_identifier_character(*from))
+			{
+				return from;
+			}
+		}
+
+		return find_first(
+			from,
+			[](__m128i chars)
+			{
+				// SSE2 only has signed byte comparisons, so we shift each range to start at -128 and check
+				// against its upper bound instead. Or-ing in 0x20 lowercases letters without creating new ones
+				__m128i lowercase = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+				__m128i letter = _mm_cmplt_epi8(_mm_add_epi8(lowercase, _mm_set1_epi8((char)(128 - 'a'))), _mm_set1_epi8((char)(-128 + 26)));
+				__m128i digit = _mm_cmplt_epi8(_mm_add_epi8(chars, _mm_set1_epi8((char)(128 - '0'))), _mm_set1_epi8((char)(-128 + 10)));
+				__m128i underscore = _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'));
+
+				__m128i identifier = _mm_or_si128(_mm_or_si128(letter, digit), underscore);
+				return _mm_cmpeq_epi8(identifier, _mm_setzero_si128());
+			}
+		);
+#else
+		while (is_identifier_character(*from))
+		{
+			from++;
+		}
+		return from;
+#endif
+	}
+
 	void skip_whitespace()
 	{
 		while (true)
@@ -66,7 +241,12 @@ namespace ScannerImpl
 				case '\r':
 				case '\t':
 				{
+					// Single blanks between tokens are by far the most common, so only look for a longer run after those
 					advance();
+					if (is_blank(peek()))
+					{
+						scanner.current = skip_blanks(scanner.current);
+					}
 					break;
 				}
 				case '\n':
@@ -80,10 +260,7 @@ namespace ScannerImpl
 					if (peek_next() == '/')
 					{
 						// Skip comment line
-						while (peek() != '\n' && !is_at_end())
-						{
-							advance();
-						}
+						scanner.current = skip_to_line_end(scanner.current);
 					}
 					else
 					{
@@ -101,13 +278,11 @@ namespace ScannerImpl
 
 	Lox::Token string()
 	{
-		while (peek() != '"' && !is_at_end())
+		scanner.current = skip_string_characters(scanner.current);
+		while (peek() == '\n')
 		{
-			if (peek() == '\n')
-			{
-				scanner.line++;
-			}
-			advance();
+			scanner.line++;
+			scanner.current = skip_string_characters(scanner.current + 1);
 		}
 
 		if (is_at_end())
@@ -156,72 +331,75 @@ namespace ScannerImpl
 			   c == '_';
 	}
 
-	Lox::TokenType check_keyword(i32 start, i32 length, const char* rest, Lox::TokenType type)
+	struct Keyword
 	{
-		if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0)
-		{
-			return type;
-		}
+		const char* text = nullptr;
+		i32 length = 0;
+		Lox::TokenType type = Lox::TokenType::IDENTIFIER;
+	};
 
-		return Lox::TokenType::IDENTIFIER;
+	// All keywords have between 2 and 6 characters, and the second character plus 8 times the length
+	// happens to be different for each one of them, which gives us a perfect hash into a table of 32 entries
+	constexpr i32 KEYWORD_MIN_LENGTH = 2;
+	constexpr i32 KEYWORD_MAX_LENGTH = 6;
+	constexpr u32 KEYWORD_TABLE_SIZE = 32;
+
+	constexpr u32 keyword_hash(const char* text, i32 length)
+	{
+		return ((u32)(u8)text[1] + ((u32)length << 3)) & (KEYWORD_TABLE_SIZE - 1);
 	}
 
-	Lox::TokenType identifier_type()
+	static constexpr std::array<Keyword, KEYWORD_TABLE_SIZE> keywords = []()
 	{
-		switch (scanner.start[0])
+		std::array<Keyword, KEYWORD_TABLE_SIZE> result;
+
+		const Keyword all_keywords[] = {
+			{"and", 3, Lox::TokenType::AND},
+			{"class", 5, Lox::TokenType::CLASS},
+			{"else", 4, Lox::TokenType::ELSE},
+			{"false", 5, Lox::TokenType::FALSE},
+			{"for", 3, Lox::TokenType::FOR},
+			{"fun", 3, Lox::TokenType::FUN},
+			{"if", 2, Lox::TokenType::IF},
+			{"nil", 3, Lox::TokenType::NIL},
+			{"or", 2, Lox::TokenType::OR},
+			{"print", 5, Lox::TokenType::PRINT},
+			{"return", 6, Lox::TokenType::RETURN},
+			{"super", 5, Lox::TokenType::SUPER},
+			{"this", 4, Lox::TokenType::THIS},
+			{"true", 4, Lox::TokenType::TRUE},
+			{"var", 3, Lox::TokenType::VAR},
+			{"while", 5, Lox::TokenType::WHILE},
+		};
+
+		for (const Keyword& keyword : all_keywords)
 		{
-			case 'a':
-				return check_keyword(1, 2, "nd", Lox::TokenType::AND);
-			case 'c':
-				return check_keyword(1, 4, "lass", Lox::TokenType::CLASS);
-			case 'e':
-				return check_keyword(1, 3, "lse", Lox::TokenType::ELSE);
-			case 'f':
-			{
-				if (scanner.current - scanner.start > 1)
-				{
-					switch (scanner.start[1])
-					{
-						case 'a':
-							return check_keyword(2, 3, "lse", Lox::TokenType::FALSE);
-						case 'o':
-							return check_keyword(2, 1, "r", Lox::TokenType::FOR);
-						case 'u':
-							return check_keyword(2, 1, "n", Lox::TokenType::FUN);
-					}
-				}
-				break;
-			}
-			case 'i':
-				return check_keyword(1, 1, "f", Lox::TokenType::IF);
-			case 'n':
-				return check_keyword(1, 2, "il", Lox::TokenType::NIL);
-			case 'o':
-				return check_keyword(1, 1, "r", Lox::TokenType::OR);
-			case 'p':
-				return check_keyword(1, 4, "rint", Lox::TokenType::PRINT);
-			case 'r':
-				return check_keyword(1, 5, "eturn", Lox::TokenType::RETURN);
-			case 's':
-				return check_keyword(1, 4, "uper", Lox::TokenType::SUPER);
-			case 't':
+			Keyword& slot = result[keyword_hash(keyword.text, keyword.length)];
+
+			// Fails compilation if a new keyword ever collides with an existing one
+			if (slot.text != nullptr)
 			{
-				if (scanner.current - scanner.start > 1)
-				{
-					switch (scanner.start[1])
-					{
-						case 'h':
-							return check_keyword(2, 2, "is", Lox::TokenType::THIS);
-						case 'r':
-							return check_keyword(2, 2, "ue", Lox::TokenType::TRUE);
-					}
-				}
-				break;
+				throw "Keyword hash collision";
 			}
-			case 'v':
-				return check_keyword(1, 2, "ar", Lox::TokenType::VAR);
-			case 'w':
-				return check_keyword(1, 4, "hile", Lox::TokenType::WHILE);
+
+			slot = keyword;
+		}
+
+		return result;
+	}();
+
+	Lox::TokenType identifier_type()
+	{
+		const i32 length = (i32)(scanner.current - scanner.start);
+		if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+		{
+			return Lox::TokenType::IDENTIFIER;
+		}
+
+		const Keyword& keyword = keywords[keyword_hash(scanner.start, length)];
+		if (keyword.length == length && std::memcmp(scanner.start, keyword.text, length) == 0)
+		{
+			return keyword.type;
 		}
 
 		return Lox::TokenType::IDENTIFIER;
@@ -229,10 +407,7 @@ namespace ScannerImpl
 
 	Lox::Token identifier()
 	{
-		while (is_alpha(peek()) || is_digit(peek()))
-		{
-			advance();
-		}
+		scanner.current = skip_identifier_characters(scanner.current);
 
 		return Lox::Token{identifier_type()};
 	}
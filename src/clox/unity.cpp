@@ -1,6 +1,10 @@
+#include "alloc_profiler.cpp"
+#include "bytecode_cache.cpp"
 #include "chunk.cpp"
 #include "compiler.cpp"
+#include "heap_image.cpp"
 #include "main.cpp"
+#include "mapped_file.cpp"
 #include "memory.cpp"
 #include "object.cpp"
 #include "scanner.cpp"
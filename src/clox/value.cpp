@@ -111,37 +111,37 @@ Lox::Object* Lox::as_object(const Lox::Value& val)
 Lox::ObjectString* Lox::as_string(const Lox::Value& val)
 {
 	Lox::Object* obj = as_object(val);
-	return dynamic_cast<Lox::ObjectString*>(obj);
+	return object_cast<Lox::ObjectString>(obj);
 }
 
 Lox::ObjectFunction* Lox::as_function(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectFunction*>(as_object(val));
+	return object_cast<Lox::ObjectFunction>(as_object(val));
 }
 
 Lox::ObjectClosure* Lox::as_closure(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectClosure*>(as_object(val));
+	return object_cast<Lox::ObjectClosure>(as_object(val));
 }
 
 Lox::ObjectNativeFunction* Lox::as_native(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectNativeFunction*>(as_object(val));
+	return object_cast<Lox::ObjectNativeFunction>(as_object(val));
 }
 
 Lox::ObjectClass* Lox::as_class(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectClass*>(as_object(val));
+	return object_cast<Lox::ObjectClass>(as_object(val));
 }
 
 Lox::ObjectInstance* Lox::as_instance(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectInstance*>(as_object(val));
+	return object_cast<Lox::ObjectInstance>(as_object(val));
 }
 
 Lox::ObjectBoundMethod* Lox::as_bound_method(const Lox::Value& val)
 {
-	return dynamic_cast<Lox::ObjectBoundMethod*>(as_object(val));
+	return object_cast<Lox::ObjectBoundMethod>(as_object(val));
 }
 
 bool Lox::values_equal(const Lox::Value& left_val, const Lox::Value& right_val)
@@ -24,6 +24,70 @@ namespace VMImpl
 		return (double)clock() / CLOCKS_PER_SEC;
 	}
 
+	// heapCount(name) and heapBytes(name) look up an entry of the heap census by the name --heap-census prints
+	// for it, like heapCount("instances of Point"). Without a name, they give the totals of the whole heap
+	Value heap_census_native(i32 arg_count, Value* args, bool want_bytes)
+	{
+		HeapCensus census = take_heap_census();
+		if (arg_count == 0)
+		{
+			std::size_t count = 0;
+			for (const HeapCensusEntry& entry : census.objects)
+			{
+				count += entry.count;
+			}
+			return (double)(want_bytes ? census.total_bytes : count);
+		}
+
+		if (!is_string(args[0]))
+		{
+			return nullptr;
+		}
+
+		// Anything the census has no entry for has nothing of it on the heap
+		const HeapCensusEntry* entry = census.find(std::string_view{as_string(args[0])->get_string()});
+		if (entry == nullptr)
+		{
+			return 0.0;
+		}
+		return (double)(want_bytes ? entry->bytes : entry->count);
+	}
+
+	Value heap_count_native(i32 arg_count, Value* args)
+	{
+		return heap_census_native(arg_count, args, false);
+	}
+
+	Value heap_bytes_native(i32 arg_count, Value* args)
+	{
+		return heap_census_native(arg_count, args, true);
+	}
+
+	// heapSnapshot(path) writes a heap snapshot to path, see write_heap_snapshot(), and returns whether that worked
+	Value heap_snapshot_native(i32 arg_count, Value* args)
+	{
+		if (arg_count != 1 || !is_string(args[0]))
+		{
+			return nullptr;
+		}
+
+		return write_heap_snapshot(as_string(args[0])->get_string().c_str());
+	}
+
+	struct NativeDefinition
+	{
+		const char* name;
+		NativeFn function;
+	};
+
+	// Every VM starts out with these as globals
+	constexpr NativeDefinition NATIVES[] = {
+		{"clock", clock_native},
+		{"heapCount", heap_count_native},
+		{"heapBytes", heap_bytes_native},
+		{"heapSnapshot", heap_snapshot_native},
+	};
+
 	void reset_stack()
 	{
 		vm.open_upvalues = nullptr;
@@ -41,7 +105,7 @@ namespace VMImpl
 			ObjectFunction* function = frame->closure->function;
 			size_t instruction = frame->ip - function->chunk.code.data() - 1;	 // -1 because the ip points at th enext instruction, and we
 																				 // want to report about the one that failed (last one)
-			std::cerr << std::format("[line {}] in ", function->chunk.lines[instruction]);
+			std::cerr << std::format("[line {}] in ", function->chunk.get_line((i32)instruction));
 
 			if (function->name == nullptr)
 			{
@@ -87,34 +151,58 @@ namespace VMImpl
 		return (u16)((frame->ip[-2] << 8) | frame->ip[-1]);
 	}
 
-	Value read_constant(CallFrame* frame)
+	u32 read_wide(CallFrame* frame)
 	{
-		return frame->closure->function->chunk.constants[read_byte(frame)];
+		frame->ip += 3;
+		return (u32)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]);
 	}
 
-	void concatenate()
+	// Index operands are a single byte, unless the instruction came after a WIDE prefix.
+	// Reading the operand consumes the prefix, so that it only ever applies to a single instruction
+	u32 read_operand(CallFrame* frame, bool& wide)
 	{
-		// Peek them here because it keeps the values inside the stack while we allocate
-		// a new ObjectString (which can trigger GC)
-		ObjectString* b = as_string(peek(0));
-		ObjectString* a = as_string(peek(1));
+		if (wide)
+		{
+			wide = false;
+			return read_wide(frame);
+		}
 
-		ObjectString* concat = Lox::ObjectString::allocate(a->get_string() + b->get_string());
-		pop();	  // Finally pop 'a' and 'b' off the stack
-		pop();
-		push(concat);
+		return read_byte(frame);
 	}
 
-	void define_native(const char* name, NativeFn function)
+	// Jump offsets are the same, except that they take two bytes without the prefix
+	u32 read_jump(CallFrame* frame, bool& wide)
 	{
-		push(ObjectString::allocate(name));
-		push(ObjectNativeFunction::allocate(function));
+		if (wide)
+		{
+			wide = false;
+			return read_wide(frame);
+		}
 
-		// TODO: Why not relative to current stack pos?
-		vm.globals[as_string(vm.stack[0])] = vm.stack[1];
+		return read_short(frame);
+	}
 
-		pop();
-		pop();
+	Value read_constant(CallFrame* frame, bool& wide)
+	{
+		return frame->closure->function->chunk.constants[read_operand(frame, wide)];
+	}
+
+	void concatenate()
+	{
+		ObjectString* b = as_string(pop());
+		ObjectString* a = as_string(pop());
+		push(Lox::ObjectString::allocate(a->get_string() + b->get_string()));
+	}
+
+	void define_native(const char* name, NativeFn function)
+	{
+		ObjectString* name_string = ObjectString::allocate(name);
+		ObjectNativeFunction* native = ObjectNativeFunction::allocate(function);
+
+		HeapWriteLock lock;
+		Value& global = vm.globals[name_string];
+		write_barrier_global(name_string, global, native);
+		global = native;
 	}
 
 	bool call(ObjectClosure* closure, i32 arg_count)
@@ -125,7 +213,11 @@ namespace VMImpl
 			return false;
 		}
 
-		if (vm.frames_position == FRAMES_MAX)
+		// The -1 accounts for stack slot zero, which the compiler sets aside
+		i32 first_slot = vm.stack_position - arg_count - 1;
+
+		// Functions can have more locals than their share of the stack, and push() doesn't check, so make sure they fit up front
+		if (vm.frames_position == FRAMES_MAX || first_slot + closure->function->max_slots > STACK_MAX)
 		{
 			runtime_error("Stack overflow");
 			return false;
@@ -134,7 +226,7 @@ namespace VMImpl
 		CallFrame* frame = &vm.frames[vm.frames_position++];
 		frame->closure = closure;
 		frame->ip = closure->function->chunk.code.data();
-		frame->slots = &vm.stack[vm.stack_position - arg_count - 1];	// The -1 accounts for stack slot zero, which the compiler sets aside
+		frame->slots = &vm.stack[first_slot];
 		return true;
 	}
 
@@ -142,41 +234,50 @@ namespace VMImpl
 	{
 		if (Object* callee_object = as_object(callee))
 		{
-			if (ObjectClosure* closure = dynamic_cast<ObjectClosure*>(callee_object))
-			{
-				return call(closure, arg_count);
-			}
-			else if (ObjectNativeFunction* native = dynamic_cast<ObjectNativeFunction*>(callee_object))
+			switch (callee_object->type)
 			{
-				NativeFn native_func = native->function;
-				Value result = native_func(arg_count, &vm.stack[vm.stack_position] - arg_count);
-				vm.stack_position -= arg_count + 1;
-				push(result);
-				return true;
-			}
-			else if (ObjectClass* klass = dynamic_cast<ObjectClass*>(callee_object))
-			{
-				vm.stack[vm.stack_position - arg_count - 1] = ObjectInstance::allocate(klass);
-
-				// Call initializer if it's defined
-				auto iter = klass->methods.find(vm.init_string);
-				if (iter != klass->methods.end())
+				case ObjectType::CLOSURE:
 				{
-					return call(as_closure(iter->second), arg_count);
+					return call(static_cast<ObjectClosure*>(callee_object), arg_count);
 				}
-				else if (arg_count != 0)
+				case ObjectType::NATIVE_FUNCTION:
 				{
-					runtime_error(std::format("Expected 0 arguments but got {}", arg_count).c_str());
-					return false;
+					NativeFn native_func = static_cast<ObjectNativeFunction*>(callee_object)->function;
+					Value result = native_func(arg_count, &vm.stack[vm.stack_position] - arg_count);
+					vm.stack_position -= arg_count + 1;
+					push(result);
+					return true;
 				}
+				case ObjectType::CLASS:
+				{
+					ObjectClass* klass = static_cast<ObjectClass*>(callee_object);
+					vm.stack[vm.stack_position - arg_count - 1] = ObjectInstance::allocate(klass);
 
-				return true;
-			}
-			else if (ObjectBoundMethod* bound = dynamic_cast<ObjectBoundMethod*>(callee_object))
-			{
-				// Place the receiver at slot zero of the stack so that we can find it there when executing bound methods
-				vm.stack[vm.stack_position - arg_count - 1] = bound->receiver;
-				return call(bound->method, arg_count);
+					// Call initializer if it's defined
+					auto iter = klass->methods.find(vm.init_string);
+					if (iter != klass->methods.end())
+					{
+						return call(as_closure(iter->second), arg_count);
+					}
+					else if (arg_count != 0)
+					{
+						runtime_error(std::format("Expected 0 arguments but got {}", arg_count).c_str());
+						return false;
+					}
+
+					return true;
+				}
+				case ObjectType::BOUND_METHOD:
+				{
+					// Place the receiver at slot zero of the stack so that we can find it there when executing bound methods
+					ObjectBoundMethod* bound = static_cast<ObjectBoundMethod*>(callee_object);
+					vm.stack[vm.stack_position - arg_count - 1] = bound->receiver;
+					return call(bound->method, arg_count);
+				}
+				default:
+				{
+					break;
+				}
 			}
 		}
 
@@ -273,6 +374,8 @@ namespace VMImpl
 		while (vm.open_upvalues != nullptr && vm.open_upvalues->location >= last)
 		{
 			ObjectUpvalue* upvalue = vm.open_upvalues;
+			HeapWriteLock lock;
+			write_barrier(upvalue, upvalue->closed, *upvalue->location);
 			upvalue->closed = *upvalue->location;
 			upvalue->location = &upvalue->closed;
 			vm.open_upvalues = upvalue->next_upvalue;
@@ -283,13 +386,43 @@ namespace VMImpl
 	{
 		Value method = peek(0);
 		ObjectClass* klass = as_class(peek(1));
-		klass->methods[name] = method;
+		HeapWriteLock lock;
+		Value& slot = klass->methods[name];
+		write_barrier(klass, nullptr, name);
+		write_barrier(klass, slot, method);
+		slot = method;
 		pop();	  // Pop the closure, we don't need it on the stack anymore
 	}
 
+	// The allocator never collects garbage itself, as minor collections and compaction move objects around, and even
+	// the others would have to find every object that's only held on to by C++ locals. The VM collects at points where
+	// it holds all of its objects in its stack and frames instead: Back-edges, calls, returns and the instructions that
+	// allocate objects, once they're done
+	void safepoint()
+	{
+#if USE_GENERATIONAL_GC
+		if (nursery_full || gc_policy.stress)
+		{
+			collect_nursery();
+		}
+#endif
+		maybe_collect_garbage();
+#if USE_COMPACTING_GC
+		if (compaction_pending)
+		{
+			compact_heap();
+		}
+#endif
+		if (heap_snapshot_requested.load(std::memory_order_relaxed))
+		{
+			write_requested_heap_snapshot();
+		}
+	}
+
 	InterpretResult run()
 	{
 		CallFrame* frame = &vm.frames[vm.frames_position - 1];
+		bool wide = false;	  // Set by Op::WIDE for the instruction that follows it
 
 #if DEBUG_TRACE_EXECUTION
 		std::cout << "----------------------" << std::endl;
@@ -306,7 +439,11 @@ namespace VMImpl
 			}
 			std::cout << "]" << std::endl;
 
-			frame->closure->function->chunk.disassemble_instruction((i32)(frame->ip - frame->closure->function->chunk.code.data()));
+			// A WIDE prefix already disassembled the whole instruction that follows it
+			if (!wide)
+			{
+				frame->closure->function->chunk.disassemble_instruction((i32)(frame->ip - frame->closure->function->chunk.code.data()));
+			}
 #endif
 
 			Op instruction = static_cast<Op>(read_byte(frame));
@@ -314,7 +451,7 @@ namespace VMImpl
 			{
 				case Op::CONSTANT:
 				{
-					Value constant = read_constant(frame);
+					Value constant = read_constant(frame, wide);
 					push(constant);
 					break;
 				}
@@ -342,7 +479,7 @@ namespace VMImpl
 				{
 					// Yes this pushes a copy of the value back onto the stack. The idea being that
 					// other bytecode instructions will look for data only at the top of the stack
-					u8 slot = read_byte(frame);
+					u32 slot = read_operand(frame, wide);
 					push(frame->slots[slot]);
 					break;
 				}
@@ -350,14 +487,14 @@ namespace VMImpl
 				{
 					// Note that it doesn't pop, as assignment is an expression and every expression produces
 					// a value (here the assigned value itself). Tthe value is left at the top of the stack
-					u8 slot = read_byte(frame);
+					u32 slot = read_operand(frame, wide);
 					frame->slots[slot] = peek(0);
 					break;
 				}
 				case Op::GET_GLOBAL:
 				{
 					// Variable name is stored as a constant
-					Lox::Value val = read_constant(frame);
+					Lox::Value val = read_constant(frame, wide);
 					Lox::ObjectString* obj_string = as_string(val);
 					const Lox::String& variable_name = obj_string->get_string();
 
@@ -377,17 +514,20 @@ namespace VMImpl
 				case Op::DEFINE_GLOBAL:
 				{
 					// Variable name is stored as a constant
-					Lox::Value val = read_constant(frame);
+					Lox::Value val = read_constant(frame, wide);
 					Lox::ObjectString* obj_string = as_string(val);
 
-					vm.globals[obj_string] = peek(0);	 // Initializer value
+					HeapWriteLock lock;
+					Lox::Value& global = vm.globals[obj_string];
+					write_barrier_global(obj_string, global, peek(0));
+					global = peek(0);	 // Initializer value
 					pop();
 					break;
 				}
 				case Op::SET_GLOBAL:
 				{
 					// Variable name is stored as a constant
-					Lox::Value val = read_constant(frame);
+					Lox::Value val = read_constant(frame, wide);
 					Lox::ObjectString* obj_string = as_string(val);
 					const Lox::String& variable_name = obj_string->get_string();
 
@@ -395,7 +535,9 @@ namespace VMImpl
 					auto iter = vm.globals.find(obj_string);
 					if (iter != vm.globals.end())
 					{
-						vm.globals[obj_string] = peek(0);
+						HeapWriteLock lock;
+						write_barrier_global(obj_string, iter->second, peek(0));
+						iter->second = peek(0);
 					}
 					else
 					{
@@ -411,14 +553,17 @@ namespace VMImpl
 				}
 				case Op::GET_UPVALUE:
 				{
-					u8 slot = read_byte(frame);
+					u32 slot = read_operand(frame, wide);
 					push(*frame->closure->upvalues[slot]->location);
 					break;
 				}
 				case Op::SET_UPVALUE:
 				{
-					u8 slot = read_byte(frame);
-					*frame->closure->upvalues[slot]->location = peek(0);
+					u32 slot = read_operand(frame, wide);
+					ObjectUpvalue* upvalue = frame->closure->upvalues[slot];
+					HeapWriteLock lock;
+					write_barrier(upvalue, *upvalue->location, peek(0));
+					*upvalue->location = peek(0);
 					break;
 				}
 				case Op::GET_PROPERTY:
@@ -430,7 +575,7 @@ namespace VMImpl
 					}
 
 					Lox::ObjectInstance* instance = as_instance(peek(0));
-					Lox::ObjectString* prop_name = as_string(read_constant(frame));
+					Lox::ObjectString* prop_name = as_string(read_constant(frame, wide));
 
 					auto iter = instance->fields.find(prop_name);
 					if (iter != instance->fields.end())
@@ -455,8 +600,12 @@ namespace VMImpl
 					}
 
 					Lox::ObjectInstance* instance = as_instance(peek(1));
-					Lox::ObjectString* prop_name = as_string(read_constant(frame));
-					instance->fields[prop_name] = peek(0);
+					Lox::ObjectString* prop_name = as_string(read_constant(frame, wide));
+					HeapWriteLock lock;
+					Value& field = instance->fields[prop_name];
+					write_barrier(instance, nullptr, prop_name);
+					write_barrier(instance, field, peek(0));
+					field = peek(0);
 					Value value = pop();
 					pop();
 					push(value);
@@ -464,7 +613,7 @@ namespace VMImpl
 				}
 				case Op::GET_SUPER:
 				{
-					ObjectString* name = as_string(read_constant(frame));
+					ObjectString* name = as_string(read_constant(frame, wide));
 					ObjectClass* superclass = as_class(pop());
 
 					if (!bind_method(superclass, name))
@@ -509,6 +658,7 @@ namespace VMImpl
 					if (is_string(peek(0)) && is_string(peek(1)))
 					{
 						concatenate();
+						safepoint();
 					}
 					else if (is_number(peek(0)) && is_number(peek(1)))
 					{
@@ -583,13 +733,13 @@ namespace VMImpl
 				}
 				case Op::JUMP:
 				{
-					u16 offset = read_short(frame);
+					u32 offset = read_jump(frame, wide);
 					frame->ip += offset;
 					break;
 				}
 				case Op::JUMP_IF_FALSE:
 				{
-					u16 offset = read_short(frame);
+					u32 offset = read_jump(frame, wide);
 					if (is_falsey(peek(0)))
 					{
 						frame->ip += offset;
@@ -598,12 +748,14 @@ namespace VMImpl
 				}
 				case Op::LOOP:
 				{
-					u16 offset = read_short(frame);
+					u32 offset = read_jump(frame, wide);
 					frame->ip -= offset;
+					safepoint();
 					break;
 				}
 				case Op::CALL:
 				{
+					safepoint();
 					u8 arg_count = read_byte(frame);
 					if (!call_value(peek(arg_count), arg_count))
 					{
@@ -615,7 +767,8 @@ namespace VMImpl
 				}
 				case Op::INVOKE:
 				{
-					ObjectString* method_name = as_string(read_constant(frame));
+					safepoint();
+					ObjectString* method_name = as_string(read_constant(frame, wide));
 					i32 arg_count = read_byte(frame);
 
 					if (!invoke(method_name, arg_count))
@@ -630,7 +783,8 @@ namespace VMImpl
 				}
 				case Op::SUPER_INVOKE:
 				{
-					ObjectString* method_name = as_string(read_constant(frame));
+					safepoint();
+					ObjectString* method_name = as_string(read_constant(frame, wide));
 					i32 arg_count = read_byte(frame);
 
 					ObjectClass* superclass = as_class(pop());
@@ -644,14 +798,16 @@ namespace VMImpl
 				}
 				case Op::CLOSURE:
 				{
-					ObjectFunction* function = as_function(read_constant(frame));
+					// The WIDE prefix covers the upvalue indices as well, so remember it before reading the function
+					bool wide_upvalues = wide;
+					ObjectFunction* function = as_function(read_constant(frame, wide));
 					ObjectClosure* closure = ObjectClosure::allocate(function);
 					push(closure);
 
 					for (i32 i = 0; i < function->upvalue_count; ++i)
 					{
 						u8 is_local = read_byte(frame);
-						u8 index = read_byte(frame);
+						u32 index = wide_upvalues ? read_wide(frame) : read_byte(frame);
 						if (is_local)
 						{
 							closure->upvalues.push_back(capture_upvalue(frame->slots + index));
@@ -664,6 +820,7 @@ namespace VMImpl
 						}
 					}
 
+					safepoint();
 					break;
 				}
 				case Op::CLOSE_UPVALUE:
@@ -674,6 +831,7 @@ namespace VMImpl
 				}
 				case Op::RETURN:
 				{
+					safepoint();
 					Value result = pop();
 					close_upvalues(frame->slots);
 					vm.frames_position--;
@@ -690,10 +848,11 @@ namespace VMImpl
 				}
 				case Op::CLASS:
 				{
-					Lox::Value val = read_constant(frame);
+					Lox::Value val = read_constant(frame, wide);
 					Lox::ObjectString* name = as_string(val);
 					Lox::ObjectClass* klass = Lox::ObjectClass::allocate(name);
 					push(klass);
+					safepoint();
 					break;
 				}
 				case Op::INHERIT:
@@ -710,9 +869,13 @@ namespace VMImpl
 					// TODO: I think I can just copy the entire map directly here as the
 					// subclass' method table should be empty at this point? I'll wait to see
 					// where the book goes though
+					HeapWriteLock lock;
 					for (const auto& [key, val] : as_class(superclass)->methods)
 					{
-						subclass->methods[key] = val;
+						Value& method = subclass->methods[key];
+						write_barrier(subclass, nullptr, key);
+						write_barrier(subclass, method, val);
+						method = val;
 					}
 
 					pop();	  // subclass
@@ -720,7 +883,12 @@ namespace VMImpl
 				}
 				case Op::METHOD:
 				{
-					define_method(as_string(read_constant(frame)));
+					define_method(as_string(read_constant(frame, wide)));
+					break;
+				}
+				case Op::WIDE:
+				{
+					wide = true;
 					break;
 				}
 				default:
@@ -738,10 +906,40 @@ void Lox::init_VM()
 
 	reset_stack();
 
-	vm.init_string = nullptr;	 // Zero this out because ObjectString::allocate may trigger GC and try to read garbage from this
 	vm.init_string = ObjectString::allocate("init");
 
-	define_native("clock", clock_native);
+	for (const NativeDefinition& native : NATIVES)
+	{
+		define_native(native.name, native.function);
+	}
+}
+
+const char* Lox::get_native_name(NativeFn function)
+{
+	using namespace VMImpl;
+
+	for (const NativeDefinition& native : NATIVES)
+	{
+		if (native.function == function)
+		{
+			return native.name;
+		}
+	}
+	return nullptr;
+}
+
+Lox::NativeFn Lox::find_native(std::string_view name)
+{
+	using namespace VMImpl;
+
+	for (const NativeDefinition& native : NATIVES)
+	{
+		if (name == native.name)
+		{
+			return native.function;
+		}
+	}
+	return nullptr;
 }
 
 void Lox::push(Lox::Value value)
@@ -765,16 +963,28 @@ Lox::InterpretResult Lox::interpret(const char* source)
 		return Lox::InterpretResult::COMPILE_ERROR;
 	}
 
-	// Force GC to retain the function while we allocate a new closure to wrap it with
-	push(function);
-	ObjectClosure* closure = ObjectClosure::allocate(function);
-	pop();
+	return interpret(function);
+}
+
+Lox::InterpretResult Lox::interpret(ObjectFunction* function)
+{
+	using namespace VMImpl;
 
-	// Put the closure itself into stack slot zero (the compiler set this aside for us).
-	push(closure);
-	call(closure, 0);
+	try
+	{
+		// Put the closure itself into stack slot zero (the compiler set this aside for us).
+		ObjectClosure* closure = ObjectClosure::allocate(function);
+		push(closure);
+		call(closure, 0);
 
-	return run();
+		return run();
+	}
+	catch (const HeapLimitExceeded&)
+	{
+		// A safepoint threw this, in between instructions, so whatever the script built so far is just garbage now
+		runtime_error(std::format("Out of memory, the heap is limited to {} bytes", gc_policy.heap_limit_bytes).c_str());
+		return InterpretResult::RUNTIME_ERROR;
+	}
 }
 
 void Lox::free_VM()
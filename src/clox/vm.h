@@ -2,9 +2,11 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "object.h"
 
 #include <array>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 #define FRAMES_MAX 64
@@ -12,8 +14,6 @@
 
 namespace Lox
 {
-	class ObjectUpvalue;
-
 	enum class InterpretResult
 	{
 		OK,
@@ -37,25 +37,27 @@ namespace Lox
 		std::array<Lox::Value, STACK_MAX> stack;
 		i32 stack_position = 0;	   // Points at the *next free position*
 
-		Lox::Object* objects = nullptr;
-
 		// Where we collect interned strings
 		// The book basically has a hash set here. By using the underlying string as key
 		// we can kind of get the same behavior without having to implement std::hash for the pointer type itself.
 		// We'll have an extra copy of the Lox::String I guess, but I don't particularly care about that yet
-		//
-		// TODO: Using Lox::Map here is troublesome because we don't want to run garbage collection and
-		// try traversing the map *while it is allocating internal nodes*, as that seems to crash
-		std::unordered_map<Lox::String, Lox::ObjectString*> strings;
+		Lox::Map<Lox::String, Lox::ObjectString*, HeapUse::STRING_TABLE> strings;
 		Lox::ObjectString* init_string = nullptr;
 
 		ObjectUpvalue* open_upvalues = nullptr;
 
 		// Global variables stored by hash of the name string
-		std::unordered_map<Lox::ObjectString*, Lox::Value> globals;
+		Lox::Map<Lox::ObjectString*, Lox::Value, HeapUse::GLOBALS> globals;
 
 		// vector and not Lox::Vec as the garbage collector shouldn't manage this
 		std::vector<Lox::Object*> gray_stack;
+
+		// Every object allocated in the nursery since the last minor collection
+		std::vector<Lox::Object*> young_objects;
+
+		// Old objects and globals that were assigned young values since the last minor collection
+		std::vector<Lox::Object*> remembered_objects;
+		std::vector<Lox::ObjectString*> remembered_globals;
 	};
 
 	extern VM vm;
@@ -64,5 +66,11 @@ namespace Lox
 	void push(Lox::Value value);
 	Lox::Value pop();
 	InterpretResult interpret(const char* source);
+	InterpretResult interpret(ObjectFunction* function);
 	void free_VM();
+
+	// Natives can't be stored as function pointers, which differ from run to run, so heap images refer to them by the name
+	// of the global every VM defines them as. These return nullptr for functions and names that aren't natives
+	const char* get_native_name(NativeFn function);
+	NativeFn find_native(std::string_view name);
 }	 // namespace Lox